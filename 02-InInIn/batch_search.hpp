@@ -0,0 +1,106 @@
+#ifndef _ii_batch_search_hpp
+#define _ii_batch_search_hpp
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    namespace {
+        // Runs job(i) for i in [0, count) on the hardware threads
+        template<typename Job>
+        void parallel_for(size_t count, Job &&job) {
+            uint32_t thread_count = std::thread::hardware_concurrency();
+            if (thread_count == 0) thread_count = 1;
+            if (thread_count > count) thread_count = count;
+
+            std::atomic<size_t> next_index(0);
+            std::vector<std::thread> workers;
+            for (uint32_t t = 0; t < thread_count; ++t) {
+                workers.push_back(std::thread([&]() {
+                    for (size_t i = next_index++; i < count; i = next_index++) job(i);
+                }));
+            }
+
+            for (auto &t : workers)
+                t.join();
+        }
+    } // namespace
+
+    /*
+     * Searches a batch of queries, callback(query_index, document_id) gets the results of each query
+     * in one piece (the queries complete in arbitrary order).
+     *
+     * Posting lists used by several queries of the batch are decoded only once into shared buffers,
+     * the queries are then intersected in parallel, one query per thread.
+     */
+    template<class Queries, class OutFn>
+    void search_batch(const uint64_t *segment, size_t size, Queries &&queries, OutFn &&callback) {
+        Storage features(segment);
+
+        // Normalized queries
+        std::vector<std::vector<FeatureId>> batch;
+        for (auto &&query : queries) {
+            std::vector<FeatureId> query_features;
+            for (auto &&feature_id : query) query_features.push_back(feature_id);
+            std::sort(query_features.begin(), query_features.end());
+            query_features.erase(std::unique(query_features.begin(), query_features.end()), query_features.end());
+            batch.push_back(std::move(query_features));
+        }
+
+        // Group the queries by feature
+        std::unordered_map<FeatureId, size_t> feature_uses;
+        for (auto &query : batch) {
+            for (auto feature_id : query) ++feature_uses[feature_id];
+        }
+
+        // Decode every shared list once
+        std::vector<FeatureId> shared_features;
+        for (auto &use : feature_uses) {
+            if (use.second > 1) shared_features.push_back(use.first);
+        }
+
+        std::vector<std::shared_ptr<const std::vector<DocumentId>>> decoded(shared_features.size());
+        parallel_for(shared_features.size(), [&](size_t i) {
+            auto documents = features[shared_features[i]];
+            decoded[i] = std::make_shared<const std::vector<DocumentId>>(documents.begin(), documents.end());
+        });
+
+        std::unordered_map<FeatureId, std::shared_ptr<const std::vector<DocumentId>>> shared_lists;
+        for (size_t i = 0; i < shared_features.size(); ++i) shared_lists.emplace(shared_features[i], decoded[i]);
+
+        // Queries with the same features run next to each other (their lists stay in the cache)
+        std::vector<size_t> order(batch.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return batch[a] < batch[b]; });
+
+        std::mutex output_mutex;
+        parallel_for(order.size(), [&](size_t i) {
+            const size_t query_index = order[i];
+            const auto &query = batch[query_index];
+            if (query.empty()) return;
+
+            // Start from the shortest list (estimated by its decoded or compressed size)
+            std::vector<std::pair<uint64_t, Storage::FeatureDocuments>> lists;
+            for (auto feature_id : query) {
+                auto shared = shared_lists.find(feature_id);
+                if (shared != shared_lists.end()) {
+                    lists.emplace_back(shared->second->size(), Storage::FeatureDocuments(shared->second));
+                } else {
+                    lists.emplace_back(features.documents_range(feature_id).second, features[feature_id]);
+                }
+            }
+            std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+            auto result = lists.front().second;
+            for (size_t l = 1; l < lists.size(); ++l) result = Processor::merge(result, lists[l].second);
+
+            std::lock_guard guard(output_mutex);
+            output_documents(features.document_map(), result,
+                             [&](DocumentId document_id) { callback(query_index, document_id); });
+        });
+    }
+}; // namespace ii
+
+#endif
@@ -0,0 +1,232 @@
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <set>
+#include <random>
+#include <string>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <cstddef>
+
+#include "storage.hpp"
+#include "generator.hpp"
+#include "inverted_index.hpp"
+
+/*
+ * Benchmark sweeping the generator parameters:
+ *
+ *   benchmark [--json] [--output FILE] [--queries N] [--objects N]
+ *
+ * For every workload it measures the build throughput, the index size per posting and
+ * the query latency percentiles for several Processor thread counts. One record per
+ * (workload, thread count) is written as CSV (default) or JSON lines, so the output
+ * of different runs can be compared.
+ */
+
+// Runtime counterpart of generator_params
+struct workload_params {
+    size_t feats;
+    uint64_t incr;
+    uint64_t div;
+    size_t objs;
+    double skew_exponent;
+    size_t query;
+
+    size_t n_feats() const { return feats; }
+
+    uint64_t max_incr() const { return incr; }
+
+    uint64_t incr_div() const { return div; }
+
+    size_t max_objs() const { return objs; }
+
+    uint64_t seed() const { return 123; }
+
+    double skew() const { return skew_exponent; }
+
+    size_t query_size() const { return query; }
+};
+
+struct result_record {
+    workload_params workload;
+    uint32_t threads;
+    uint64_t postings;
+    uint64_t index_bytes;
+    double build_seconds;
+    uint64_t queries;
+    double p50_us;
+    double p99_us;
+    double mean_us;
+    uint64_t result_documents;
+};
+
+typedef std::chrono::steady_clock benchmark_clock;
+
+static double seconds_since(benchmark_clock::time_point start) {
+    return std::chrono::duration<double>(benchmark_clock::now() - start).count();
+}
+
+static double percentile(std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = size_t(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Builds the index of the workload once, then measures every query size with every thread count
+static void run_workload(const workload_params &workload, const std::vector<size_t> &query_sizes,
+                         const std::vector<uint32_t> &thread_counts, size_t query_count,
+                         std::vector<result_record> &records) {
+    feature_objects_generator<workload_params> fs(workload);
+
+    uint64_t postings = 0;
+    for (uint64_t f = 0; f < fs.size(); ++f) {
+        // The generator iterators have no iterator_traits (no std::distance)
+        auto &&documents = fs[f];
+        for (auto it = documents.begin(); it != documents.end(); ++it) ++postings;
+    }
+
+    // Build (includes the generator cost, the same for every run)
+    storage s;
+    auto build_start = benchmark_clock::now();
+    ii::create(s, fs);
+    const double build_seconds = seconds_since(build_start);
+
+    // Thread counts as the processor runs them (bounded by the hardware) - each measured once
+    std::vector<uint32_t> worker_counts;
+    for (auto threads : thread_counts) {
+        auto workers = ii::Processor::worker_count(threads);
+        if (std::find(worker_counts.begin(), worker_counts.end(), workers) == worker_counts.end()) {
+            worker_counts.push_back(workers);
+        }
+    }
+
+    ii::Storage features(s.data());
+    for (auto query_size : query_sizes) {
+        workload_params measured = workload;
+        measured.query = query_size;
+
+        // The same queries for every thread count
+        std::mt19937 mt(workload.seed() + workload.max_objs() + query_size);
+        std::uniform_int_distribution<uint64_t> uid(0, workload.n_feats() - 1);
+        std::vector<std::set<uint64_t>> queries(query_count);
+        for (auto &query : queries) {
+            while (query.size() < std::min(query_size, workload.n_feats())) query.insert(uid(mt));
+        }
+
+        for (auto threads : worker_counts) {
+            std::vector<double> latencies;
+            uint64_t result_documents = 0;
+
+            for (auto &query : queries) {
+                auto query_start = benchmark_clock::now();
+
+                ii::Processor processor(features, threads);
+                auto result = processor.search(query);
+                result_documents += std::distance(result.begin(), result.end());
+
+                latencies.push_back(seconds_since(query_start) * 1e6);
+            }
+
+            double total = 0;
+            for (auto latency : latencies) total += latency;
+            std::sort(latencies.begin(), latencies.end());
+
+            records.push_back(result_record{
+                    measured, threads, postings, s.size() * sizeof(uint64_t), build_seconds, latencies.size(),
+                    percentile(latencies, 0.5), percentile(latencies, 0.99),
+                    latencies.empty() ? 0 : total / latencies.size(), result_documents
+            });
+        }
+    }
+}
+
+static void write_csv(std::ostream &out, const std::vector<result_record> &records, time_t run_time) {
+    out << "run,features,max_incr,incr_div,max_objs,skew,query_size,threads,postings,index_bytes,"
+           "bytes_per_posting,build_seconds,build_postings_per_second,queries,p50_us,p99_us,mean_us,result_documents"
+        << std::endl;
+
+    for (auto &r : records) {
+        out << run_time << ',' << r.workload.feats << ',' << r.workload.incr << ',' << r.workload.div << ','
+            << r.workload.objs << ',' << r.workload.skew_exponent << ',' << r.workload.query << ','
+            << r.threads << ',' << r.postings << ',' << r.index_bytes << ','
+            << double(r.index_bytes) / r.postings << ',' << r.build_seconds << ','
+            << r.postings / r.build_seconds << ',' << r.queries << ',' << r.p50_us << ',' << r.p99_us << ','
+            << r.mean_us << ',' << r.result_documents << std::endl;
+    }
+}
+
+static void write_json(std::ostream &out, const std::vector<result_record> &records, time_t run_time) {
+    for (auto &r : records) {
+        out << "{\"run\":" << run_time
+            << ",\"features\":" << r.workload.feats
+            << ",\"max_incr\":" << r.workload.incr
+            << ",\"incr_div\":" << r.workload.div
+            << ",\"max_objs\":" << r.workload.objs
+            << ",\"skew\":" << r.workload.skew_exponent
+            << ",\"query_size\":" << r.workload.query
+            << ",\"threads\":" << r.threads
+            << ",\"postings\":" << r.postings
+            << ",\"index_bytes\":" << r.index_bytes
+            << ",\"bytes_per_posting\":" << double(r.index_bytes) / r.postings
+            << ",\"build_seconds\":" << r.build_seconds
+            << ",\"build_postings_per_second\":" << r.postings / r.build_seconds
+            << ",\"queries\":" << r.queries
+            << ",\"p50_us\":" << r.p50_us
+            << ",\"p99_us\":" << r.p99_us
+            << ",\"mean_us\":" << r.mean_us
+            << ",\"result_documents\":" << r.result_documents
+            << "}" << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    std::string output_file;
+    size_t query_count = 200;
+    size_t objects = 100000;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") json = true;
+        else if (arg == "--output" && i + 1 < argc) output_file = argv[++i];
+        else if (arg == "--queries" && i + 1 < argc) query_count = std::stoul(argv[++i]);
+        else if (arg == "--objects" && i + 1 < argc) objects = std::stoul(argv[++i]);
+        else {
+            std::cerr << "usage: " << argv[0] << " [--json] [--output FILE] [--queries N] [--objects N]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Workloads: feature count x density (max_incr / incr_div) x query size x list length skew
+    const std::vector<size_t> feature_counts{64, 512};
+    const std::vector<std::pair<uint64_t, uint64_t>> densities{{150, 100}, {1500, 100}, {15000, 100}};
+    const std::vector<size_t> query_sizes{2, 4, 8};
+    const std::vector<double> skews{0, 1};
+    const std::vector<uint32_t> thread_counts{1, 2, 4, 8};
+
+    std::vector<result_record> records;
+    for (auto feats : feature_counts) {
+        for (auto &density : densities) {
+            for (auto skew : skews) {
+                workload_params workload{feats, density.first, density.second, objects, skew, 0};
+                run_workload(workload, query_sizes, thread_counts, query_count, records);
+                std::cerr << '.' << std::flush;
+            }
+        }
+    }
+    std::cerr << std::endl;
+
+    const time_t run_time = std::time(nullptr);
+    std::ofstream file;
+    if (!output_file.empty()) file.open(output_file);
+    std::ostream &out = output_file.empty() ? std::cout : file;
+
+    if (json) write_json(out, records, run_time);
+    else write_csv(out, records, run_time);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef _ii_cardinality_hpp
+#define _ii_cardinality_hpp
+
+#include <cmath>
+#include <algorithm>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    struct count_estimate {
+        double estimate = 0;
+        double lower = 0;   // ~95 % confidence interval
+        double upper = 0;
+        bool exact = false; // the sketches held the whole lists
+    };
+
+    /*
+     * Creates an index with a KMV sketch (the sketch_size smallest hashed document ids) and the length
+     * of every list in SECTION_SKETCHES, for estimate_count. Plain ii::search works on it as well.
+     */
+    template<typename Truncate, typename FeatureObjectLists>
+    void create_sketched(Truncate &&truncate, FeatureObjectLists &&features,
+                         uint64_t sketch_size = Writer::DEFAULT_SKETCH_SIZE) {
+
+        // Get data file size
+        uint64_t total_data = 0;
+        for (uint64_t i = 0; i < features.size(); ++i) {
+            for (auto &&_ : features[i]) ++total_data;
+        }
+
+        // Create the data file
+        uint64_t data_file_size = Writer::get_maximum_datafile_size(features.size(), total_data, FLAG_SKETCHES, 0,
+                                                                    sketch_size);
+        uint64_t *data_file = truncate(bytes_to_words(data_file_size));
+
+        // Persist the feature data
+        Writer writer(data_file, features.size(), FLAG_SKETCHES);
+        writer.set_sketch_size(sketch_size);
+
+        for (FeatureId id = 0; id < features.size(); ++id) {
+            writer.persist(id, features[id]);
+        }
+        writer.finish();
+
+        // Truncate data file to the actual size (drop pre-allocated space)
+        truncate(bytes_to_words(writer.get_current_document_size()));
+    }
+
+    /*
+     * Estimates the number of documents containing all the features from the sketches only
+     * (no posting list is read). The k smallest hashes of the sketch union estimate the union size,
+     * the share of them present in every sketch estimates the intersection within the union.
+     */
+    template<class Fs>
+    count_estimate estimate_count(const uint64_t *segment, size_t size, Fs &&fs) {
+        Storage features(segment);
+        const uint64_t k = features.sketch_size();
+        if (!k) throw std::logic_error("index file has no sketches");
+
+        count_estimate result;
+        result.exact = true;
+
+        // Valid hashes of every sketch, the intersection can't exceed the shortest list
+        std::vector<std::pair<const uint64_t *, const uint64_t *>> sketches;
+        double min_length = 0;
+        bool complete = true;
+        for (auto &&feature_id : fs) {
+            auto *sketch = features.sketch(feature_id);
+            if (!sketch || sketch[0] == 0) return result;
+
+            sketches.emplace_back(sketch + 1, sketch + 1 + std::min(sketch[0], k));
+            if (sketches.size() == 1 || sketch[0] < min_length) min_length = sketch[0];
+            if (sketch[0] > k) complete = false;
+        }
+        if (sketches.empty()) return result;
+
+        auto in_all = [&](uint64_t h) {
+            for (auto &sketch : sketches) {
+                if (!std::binary_search(sketch.first, sketch.second, h)) return false;
+            }
+            return true;
+        };
+
+        // Whole lists in the sketches => exact
+        if (complete) {
+            uint64_t count = 0;
+            for (auto *h = sketches.front().first; h != sketches.front().second; ++h) count += in_all(*h);
+            result.estimate = result.lower = result.upper = count;
+            return result;
+        }
+        result.exact = false;
+
+        // k smallest of the union
+        std::vector<uint64_t> union_hashes;
+        for (auto &sketch : sketches) union_hashes.insert(union_hashes.end(), sketch.first, sketch.second);
+        std::sort(union_hashes.begin(), union_hashes.end());
+        union_hashes.erase(std::unique(union_hashes.begin(), union_hashes.end()), union_hashes.end());
+        if (union_hashes.size() > k) union_hashes.resize(k);
+
+        const double union_k = union_hashes.size();
+        const double kth_hash = (double(union_hashes.back()) + 1) / 18446744073709551616.0; // / 2^64
+        const double union_estimate = (union_k - 1) / kth_hash;
+
+        double shared = 0;
+        for (auto h : union_hashes) shared += in_all(h);
+        const double share = shared / union_k;
+
+        // Relative error of the union ~ 1 / sqrt(k - 2), the share is binomial
+        result.estimate = share * union_estimate;
+        const double variance = result.estimate * result.estimate / std::max(union_k - 2, 1.0)
+                                + union_estimate * union_estimate * share * (1 - share) / union_k;
+        const double sigma = std::sqrt(variance);
+        result.lower = std::max(0.0, result.estimate - 2 * sigma);
+        result.upper = result.estimate + 2 * sigma;
+
+        // No shared hash - rule of three
+        if (shared == 0) result.upper = std::max(result.upper, union_estimate * 3 / union_k);
+
+        result.estimate = std::min(result.estimate, min_length);
+        result.upper = std::min(result.upper, min_length);
+        result.lower = std::min(result.lower, result.estimate);
+        return result;
+    }
+}; // namespace ii
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef _ii_document_reordering_hpp
+#define _ii_document_reordering_hpp
+
+#include <cmath>
+#include <algorithm>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    enum class document_reordering {
+        none,       // keep the original ids (plain ii::create)
+        signature,  // sort the documents by their feature sets (frequent features first)
+        bisection   // recursive graph bisection minimizing the log-gaps of the lists
+    };
+
+    namespace {
+        // Documents (densely numbered in their original order) with their features, CSR layout
+        struct DocumentFeatures {
+            std::vector<DocumentId> original_ids;
+            std::vector<uint64_t> offsets;  // features of document d: [offsets[d], offsets[d + 1])
+            std::vector<FeatureId> features;
+
+            size_t document_count() const { return original_ids.size(); }
+
+            template<typename FeatureObjectLists>
+            explicit DocumentFeatures(FeatureObjectLists &&lists) {
+                std::vector<std::pair<DocumentId, FeatureId>> postings;
+                for (FeatureId f = 0; f < lists.size(); ++f) {
+                    for (DocumentId document_id : lists[f]) postings.emplace_back(document_id, f);
+                }
+                std::sort(postings.begin(), postings.end());
+
+                features.reserve(postings.size());
+                for (size_t i = 0; i < postings.size(); ++i) {
+                    if (i == 0 || postings[i].first != postings[i - 1].first) {
+                        original_ids.push_back(postings[i].first);
+                        offsets.push_back(features.size());
+                    }
+                    features.push_back(postings[i].second);
+                }
+                offsets.push_back(features.size());
+            }
+        };
+
+        // Lexicographic order of the feature sets, features compared by decreasing document frequency
+        std::vector<uint64_t> signature_order(const DocumentFeatures &documents, uint64_t feature_count) {
+            std::vector<uint64_t> frequency(feature_count, 0);
+            for (auto f : documents.features) ++frequency[f];
+
+            std::vector<uint64_t> rank(feature_count);
+            std::vector<FeatureId> by_frequency(feature_count);
+            for (FeatureId f = 0; f < feature_count; ++f) by_frequency[f] = f;
+            std::stable_sort(by_frequency.begin(), by_frequency.end(),
+                             [&](FeatureId a, FeatureId b) { return frequency[a] > frequency[b]; });
+            for (uint64_t r = 0; r < feature_count; ++r) rank[by_frequency[r]] = r;
+
+            // Signatures = feature ranks, ascending
+            std::vector<uint64_t> signatures(documents.features.size());
+            for (size_t i = 0; i < signatures.size(); ++i) signatures[i] = rank[documents.features[i]];
+            for (size_t d = 0; d < documents.document_count(); ++d) {
+                std::sort(signatures.begin() + documents.offsets[d], signatures.begin() + documents.offsets[d + 1]);
+            }
+
+            std::vector<uint64_t> order(documents.document_count());
+            for (size_t d = 0; d < order.size(); ++d) order[d] = d;
+            std::sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+                return std::lexicographical_compare(
+                        signatures.begin() + documents.offsets[a], signatures.begin() + documents.offsets[a + 1],
+                        signatures.begin() + documents.offsets[b], signatures.begin() + documents.offsets[b + 1]);
+            });
+            return order;
+        }
+
+        /*
+         * Recursive graph bisection (Dhulipala et al.): every range of documents gets split in halves,
+         * documents are swapped between the halves while that lowers the estimated log-gap cost
+         * of the feature lists, then both halves are processed recursively.
+         */
+        class GraphBisection {
+        public:
+            static const size_t MIN_PARTITION_SIZE = 16;
+            static const size_t ITERATIONS = 12;
+            static const size_t MAX_DEPTH = 24;
+
+            GraphBisection(const DocumentFeatures &documents, uint64_t feature_count) :
+                    documents(documents),
+                    left_degrees(feature_count, 0),
+                    right_degrees(feature_count, 0) {}
+
+            std::vector<uint64_t> order() {
+                std::vector<uint64_t> result(documents.document_count());
+                for (size_t d = 0; d < result.size(); ++d) result[d] = d;
+                gains.resize(result.size());
+
+                bisect(result.data(), result.size(), 0);
+                return result;
+            }
+
+        private:
+            const DocumentFeatures &documents;
+            std::vector<int64_t> left_degrees;
+            std::vector<int64_t> right_degrees;
+            std::vector<double> gains;
+
+            // Estimated bits of a list with degree documents among size ones
+            static double cost(int64_t degree, size_t size) {
+                return degree * std::log2(double(size) / (degree + 1));
+            }
+
+            void count_degrees(const uint64_t *begin, const uint64_t *end, std::vector<int64_t> &degrees, int64_t add) {
+                for (auto *d = begin; d != end; ++d) {
+                    for (auto i = documents.offsets[*d]; i < documents.offsets[*d + 1]; ++i) {
+                        degrees[documents.features[i]] += add;
+                    }
+                }
+            }
+
+            // Cost decrease when the document moves to the other half
+            double move_gain(uint64_t document, const std::vector<int64_t> &from, size_t from_size,
+                             const std::vector<int64_t> &to, size_t to_size) const {
+                double gain = 0;
+                for (auto i = documents.offsets[document]; i < documents.offsets[document + 1]; ++i) {
+                    auto f = documents.features[i];
+                    gain += cost(from[f], from_size) + cost(to[f], to_size);
+                    gain -= cost(from[f] - 1, from_size) + cost(to[f] + 1, to_size);
+                }
+                return gain;
+            }
+
+            void bisect(uint64_t *range, size_t size, size_t depth) {
+                if (size < MIN_PARTITION_SIZE || depth >= MAX_DEPTH) return;
+
+                uint64_t *left = range;
+                const size_t left_size = size / 2;
+                uint64_t *right = range + left_size;
+                const size_t right_size = size - left_size;
+
+                count_degrees(left, right, left_degrees, 1);
+                count_degrees(right, range + size, right_degrees, 1);
+
+                for (size_t iteration = 0; iteration < ITERATIONS; ++iteration) {
+                    for (size_t i = 0; i < left_size; ++i) {
+                        gains[left[i]] = move_gain(left[i], left_degrees, left_size, right_degrees, right_size);
+                    }
+                    for (size_t i = 0; i < right_size; ++i) {
+                        gains[right[i]] = move_gain(right[i], right_degrees, right_size, left_degrees, left_size);
+                    }
+
+                    auto by_gain = [this](uint64_t a, uint64_t b) { return gains[a] > gains[b]; };
+                    std::sort(left, left + left_size, by_gain);
+                    std::sort(right, right + right_size, by_gain);
+
+                    // Swap the best pairs while the swap pays off
+                    size_t swaps = 0;
+                    for (; swaps < left_size && swaps < right_size; ++swaps) {
+                        if (gains[left[swaps]] + gains[right[swaps]] <= 0) break;
+
+                        count_degrees(left + swaps, left + swaps + 1, left_degrees, -1);
+                        count_degrees(left + swaps, left + swaps + 1, right_degrees, 1);
+                        count_degrees(right + swaps, right + swaps + 1, right_degrees, -1);
+                        count_degrees(right + swaps, right + swaps + 1, left_degrees, 1);
+                        std::swap(left[swaps], right[swaps]);
+                    }
+                    if (swaps == 0) break;
+                }
+
+                // Clean the degrees for the next partition
+                count_degrees(left, right, left_degrees, -1);
+                count_degrees(right, range + size, right_degrees, -1);
+
+                bisect(left, left_size, depth + 1);
+                bisect(right, right_size, depth + 1);
+            }
+        };
+    } // namespace
+
+    /*
+     * ii::create with an optional build stage assigning new, locality improving document ids
+     * (documents sharing features get nearby ids => smaller deltas). The index is stored under
+     * the new ids, SECTION_DOCUMENT_MAP translates the results back to the original ids.
+     */
+    template<typename Truncate, typename FeatureObjectLists>
+    void create(Truncate &&truncate, FeatureObjectLists &&features, document_reordering reordering) {
+        if (reordering == document_reordering::none) {
+            create(truncate, features);
+            return;
+        }
+
+        const uint64_t feature_count = features.size();
+        DocumentFeatures documents(features);
+
+        std::vector<uint64_t> order;
+        if (reordering == document_reordering::signature) order = signature_order(documents, feature_count);
+        else order = GraphBisection(documents, feature_count).order();
+
+        // New id = position in the order
+        std::vector<DocumentId> new_ids(order.size());
+        std::vector<DocumentId> original_ids(order.size());
+        for (size_t position = 0; position < order.size(); ++position) {
+            new_ids[order[position]] = position;
+            original_ids[position] = documents.original_ids[order[position]];
+        }
+
+        // Feature lists under the new ids
+        std::vector<std::vector<DocumentId>> lists(feature_count);
+        for (size_t d = 0; d < documents.document_count(); ++d) {
+            for (auto i = documents.offsets[d]; i < documents.offsets[d + 1]; ++i) {
+                lists[documents.features[i]].push_back(new_ids[d]);
+            }
+        }
+        for (auto &list : lists) std::sort(list.begin(), list.end());
+
+        // Create the data file
+        const uint64_t total_data = documents.features.size();
+        uint64_t data_file_size = Writer::get_maximum_datafile_size(feature_count, total_data, FLAG_REORDERED,
+                                                                    original_ids.size());
+        uint64_t *data_file = truncate(bytes_to_words(data_file_size));
+
+        // Persist the feature data
+        Writer writer(data_file, feature_count, FLAG_REORDERED);
+
+        for (FeatureId id = 0; id < feature_count; ++id) {
+            writer.persist(id, lists[id]);
+        }
+        writer.set_document_map(std::move(original_ids));
+        writer.finish();
+
+        // Truncate data file to the actual size (drop pre-allocated space)
+        truncate(bytes_to_words(writer.get_current_document_size()));
+    }
+}; // namespace ii
+
+#endif
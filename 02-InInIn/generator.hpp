@@ -0,0 +1,95 @@
+#ifndef _ii_generator_hpp
+#define _ii_generator_hpp
+
+#include <cmath>
+#include <random>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * data generator
+ *
+ * Params provides n_feats(), max_incr(), incr_div(), max_objs(), seed() and skew()
+ * (static members or - for parameter sweeps - members of the passed instance).
+ * With skew > 0 the increments of feature f grow with (f + 1)^skew, the list lengths
+ * then fall off like a power law instead of being uniform.
+ */
+template<class Params>
+class feature_objects_generator {
+    class iterator {
+        bool end;
+        uint64_t val;
+        uint64_t max_objs;
+        uint64_t incr_div;
+        std::mt19937 mt;
+        std::uniform_int_distribution<uint64_t> uid;
+
+        uint64_t increment() {
+            return uid(mt) / incr_div;
+        }
+
+        static uint64_t max_incr(const Params &params, size_t n) {
+            if (params.skew() == 0) return params.max_incr();
+            return uint64_t(params.max_incr() * std::pow(double(n + 1), params.skew()));
+        }
+
+    public:
+        uint64_t operator*() const {
+            return val;
+        }
+
+        iterator &operator++() {
+            val += 1 + increment();
+            if (val >= max_objs) end = true;
+            return *this;
+        }
+
+        bool operator==(const iterator &a) const {
+            return end == a.end;
+        }
+
+        bool operator!=(const iterator &a) const {
+            return end != a.end;
+        }
+
+        iterator(bool end, size_t n, const Params &params)
+                : end(end),
+                  max_objs(params.max_objs()),
+                  incr_div(params.incr_div()),
+                  mt(params.seed() + n),
+                  uid(0, max_incr(params, n)) {
+            val = increment();
+        }
+
+    };
+
+    class iterator_proxy {
+        uint64_t feat;
+        const Params &params;
+    public:
+        iterator_proxy(uint64_t feat, const Params &params) : feat(feat), params(params) {}
+
+        iterator begin() const {
+            return iterator(false, feat, params);
+        }
+
+        iterator end() const {
+            return iterator(true, feat, params);
+        }
+    };
+
+    Params params;
+
+public:
+    explicit feature_objects_generator(const Params &params = Params()) : params(params) {}
+
+    iterator_proxy operator[](uint64_t feat) const {
+        return iterator_proxy(feat, params);
+    }
+
+    uint64_t size() const {
+        return params.n_feats();
+    }
+};
+
+#endif
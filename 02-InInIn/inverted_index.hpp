@@ -3,12 +3,18 @@
 #define _ii_hpp
 
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
+#include <memory>
+#include <vector>
 #include <queue>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <chrono>
 
 namespace ii {
     namespace compression_helpers {
@@ -24,8 +30,9 @@ namespace ii {
             uint64_t byte_count = 0;
             uint8_t tag_continue = BITMASK_NOT_NEXT;
 
+            // At least one byte is stored (a zero delta - e.g. document 0 - would vanish otherwise)
             value -= last_value;
-            while (value > 0) {
+            do {
                 auto last_7_bits = uint8_t(value & BITMASK_LAST_7_BITS);
 
                 *data_ptr = tag_continue | last_7_bits;
@@ -34,44 +41,376 @@ namespace ii {
                 ++data_ptr;
                 ++byte_count;
                 tag_continue = BITMASK_HAS_NEXT;
-            }
+            } while (value > 0);
 
             return byte_count;
         }
 
-        uint64_t get_byte_count(const uint8_t *data_ptr) {
+        // data_end bounds the scan for continuation bytes (the value may be the last one of a buffer)
+        uint64_t get_byte_count(const uint8_t *data_ptr, const uint8_t *data_end) {
             uint64_t bc = 1;
-            for (auto i = 1; *(data_ptr + i) > BITMASK_HAS_NEXT; ++i) ++bc;
+            for (auto i = 1; data_ptr + i < data_end && (*(data_ptr + i) & BITMASK_HAS_NEXT); ++i) ++bc;
             return bc;
         }
 
-        uint64_t get_next(uint64_t last_value, const uint8_t *data_ptr) {
+        uint64_t get_next(uint64_t last_value, const uint8_t *data_ptr, const uint8_t *data_end) {
             uint64_t value = 0;
+            const uint64_t byte_count = get_byte_count(data_ptr, data_end);
 
-            for (uint32_t i = 0; i < get_byte_count(data_ptr); ++i) {
+            for (uint32_t i = 0; i < byte_count; ++i) {
                 uint64_t next_byte = *(data_ptr + i) & BITMASK_LAST_7_BITS;
                 value = value | (next_byte << (i * 7));
             }
 
             return last_value + value;
         }
+
+        /*
+         * Elias-Fano coding of a non-decreasing sequence: the low bits of every value are bit-packed,
+         * the high parts are unary coded in a bit vector (value i sets bit (value >> low_bits) + i).
+         * Every SAMPLE_RATE-th high bit position is sampled, so access and search only scan a short run.
+         *
+         * Layout (64-bit words): count, low_bits, low_words, high_words, sample_count,
+         * then the low words, the high words and the samples.
+         */
+        class EliasFano {
+        public:
+            static const uint64_t SAMPLE_RATE = 64;
+            static const uint64_t HEADER_WORDS = 5;
+
+            EliasFano() = default;
+
+            explicit EliasFano(const uint64_t *data) :
+                    count(data[0]),
+                    low_bits(data[1]),
+                    low(data + HEADER_WORDS),
+                    high(low + data[2]),
+                    samples(high + data[3]),
+                    words(HEADER_WORDS + data[2] + data[3] + data[4]) {}
+
+            static std::vector<uint64_t> encode(const std::vector<uint64_t> &values) {
+                const uint64_t n = values.size();
+                const uint64_t universe = n ? values.back() + 1 : 0;
+
+                uint64_t bits = 0;
+                if (n && universe / n > 1) bits = 63 - __builtin_clzll(universe / n);
+
+                const uint64_t low_words = (n * bits + 63) / 64;
+                const uint64_t high_words = (n + (n ? values.back() >> bits : 0) + 64) / 64;
+                const uint64_t sample_count = (n + SAMPLE_RATE - 1) / SAMPLE_RATE;
+
+                std::vector<uint64_t> data(HEADER_WORDS + low_words + high_words + sample_count, 0);
+                data[0] = n;
+                data[1] = bits;
+                data[2] = low_words;
+                data[3] = high_words;
+                data[4] = sample_count;
+
+                uint64_t *low = data.data() + HEADER_WORDS;
+                uint64_t *high = low + low_words;
+                uint64_t *samples = high + high_words;
+
+                for (uint64_t i = 0; i < n; ++i) {
+                    if (bits) {
+                        const uint64_t low_value = values[i] & ((uint64_t(1) << bits) - 1);
+                        const uint64_t bit = i * bits;
+                        low[bit / 64] |= low_value << (bit % 64);
+                        if (bit % 64 + bits > 64) low[bit / 64 + 1] |= low_value >> (64 - bit % 64);
+                    }
+
+                    const uint64_t position = (values[i] >> bits) + i;
+                    high[position / 64] |= uint64_t(1) << (position % 64);
+                    if (i % SAMPLE_RATE == 0) samples[i / SAMPLE_RATE] = position;
+                }
+
+                return data;
+            }
+
+            uint64_t size() const {
+                return count;
+            }
+
+            // Encoded size including the layout header
+            uint64_t word_count() const {
+                return words;
+            }
+
+            uint64_t operator[](uint64_t i) const {
+                uint64_t position = samples[i / SAMPLE_RATE];
+                for (uint64_t k = i % SAMPLE_RATE; k > 0; --k) position = next_one(position);
+                return value(i, position);
+            }
+
+            // Index of the first value >= v (size() if there is none)
+            uint64_t lower_bound(uint64_t v) const {
+                // First sample block starting at >= v, the answer is in the block in front of it
+                uint64_t lo = 0;
+                uint64_t hi = (count + SAMPLE_RATE - 1) / SAMPLE_RATE;
+                while (lo < hi) {
+                    uint64_t mid = (lo + hi) / 2;
+                    if (value(mid * SAMPLE_RATE, samples[mid]) < v) lo = mid + 1;
+                    else hi = mid;
+                }
+                if (lo == 0) return 0;
+
+                const uint64_t block = lo - 1;
+                const uint64_t end = std::min(count, lo * SAMPLE_RATE);
+                uint64_t position = samples[block];
+                for (uint64_t i = block * SAMPLE_RATE; i < end; ++i) {
+                    if (i > block * SAMPLE_RATE) position = next_one(position);
+                    if (value(i, position) >= v) return i;
+                }
+                return end;
+            }
+
+        private:
+            uint64_t count = 0;
+            uint64_t low_bits = 0;
+            const uint64_t *low = nullptr;
+            const uint64_t *high = nullptr;
+            const uint64_t *samples = nullptr;
+            uint64_t words = 0;
+
+            // Value i with its high bit at position
+            uint64_t value(uint64_t i, uint64_t position) const {
+                uint64_t v = (position - i) << low_bits;
+                if (low_bits) {
+                    const uint64_t bit = i * low_bits;
+                    uint64_t low_value = low[bit / 64] >> (bit % 64);
+                    if (bit % 64 + low_bits > 64) low_value |= low[bit / 64 + 1] << (64 - bit % 64);
+                    v |= low_value & ((uint64_t(1) << low_bits) - 1);
+                }
+                return v;
+            }
+
+            // Position of the next set high bit behind position
+            uint64_t next_one(uint64_t position) const {
+                ++position;
+                uint64_t word_index = position / 64;
+                uint64_t word = high[word_index] & (~uint64_t(0) << (position % 64));
+                while (!word) word = high[++word_index];
+                return word_index * 64 + __builtin_ctzll(word);
+            }
+        };
     } // namespace compression_helpers
+
+    // Per-query trace of the Processor, filled by ii::search(..., search_stats &)
+    struct search_stats {
+        // Input list (leaf) or the intersection of the nodes first and second
+        struct merge_node {
+            int64_t first = -1;             // child nodes, -1 for the input lists
+            int64_t second = -1;
+            uint64_t encoded_bytes = 0;     // compressed size of an input list
+            uint64_t documents = 0;         // size of an intermediate result (or of a decoded input list)
+            uint64_t postings_touched = 0;
+            uint32_t thread = 0;
+            uint64_t begin_ns = 0;          // relative to the query start
+            uint64_t end_ns = 0;
+        };
+
+        uint64_t lists = 0;
+        uint64_t merge_steps = 0;
+        uint64_t bytes_decoded = 0;
+        uint64_t postings_touched = 0;
+        uint64_t result_documents = 0;
+        uint32_t threads = 0;
+
+        uint64_t total_ns = 0;
+        uint64_t merge_ns = 0;  // summed over the threads
+        uint64_t wait_ns = 0;   // summed over the threads waiting for lists in the queue
+
+        // The root is the last node
+        std::vector<merge_node> merge_tree;
+
+        // Share of the worker time spent merging
+        double utilization() const {
+            if (total_ns == 0 || threads == 0) return 0;
+            return double(merge_ns) / (double(total_ns) * threads);
+        }
+
+        void dump(std::ostream &out) const {
+            out << "search: " << lists << " lists, " << merge_steps << " merges, " << threads << " threads, "
+                << total_ns / 1e6 << " ms" << std::endl;
+            out << "  decoded " << bytes_decoded << " B, touched " << postings_touched << " postings, result "
+                << result_documents << " documents" << std::endl;
+            out << "  merging " << merge_ns / 1e6 << " ms, waiting " << wait_ns / 1e6 << " ms, utilization "
+                << utilization() * 100 << " %" << std::endl;
+
+            if (!merge_tree.empty()) dump_node(out, merge_tree.size() - 1, 1);
+        }
+
+    private:
+        void dump_node(std::ostream &out, uint64_t node_index, uint32_t depth) const {
+            const auto &node = merge_tree[node_index];
+            out << std::string(depth * 2, ' ') << '#' << node_index;
+
+            if (node.first < 0) {
+                out << " list ";
+                if (node.encoded_bytes) out << node.encoded_bytes << " B";
+                else out << node.documents << " documents";
+                out << " at " << node.begin_ns / 1e6 << " ms" << std::endl;
+                return;
+            }
+
+            out << " merge " << node.documents << " documents, " << node.postings_touched << " postings, thread "
+                << node.thread << ", " << node.begin_ns / 1e6 << " - " << node.end_ns / 1e6 << " ms" << std::endl;
+            dump_node(out, node.first, depth + 1);
+            dump_node(out, node.second, depth + 1);
+        }
+    };
+
     namespace {
         typedef uint64_t DocumentId;
         typedef uint64_t FeatureId;
 
+        // Extended index files begin with a Header, plain ones directly with the Entry directory
+        // (their first word - the id of feature 0 - is always 0)
+        const uint64_t HEADER_MAGIC = 0x31305845444e4949; // "IINDEX01"
+
+        // Postings carry a quantized weight byte behind the document delta
+        const uint64_t FLAG_WEIGHTED = 0x1;
+
+        // Documents are stored under new (locality improving) ids, SECTION_DOCUMENT_MAP translates them back
+        const uint64_t FLAG_REORDERED = 0x2;
+
+        // No Entry array - SECTION_DIRECTORY holds the (sparse, increasing) feature ids and list offsets compressed
+        const uint64_t FLAG_COMPACT_DIRECTORY = 0x4;
+
+        // SECTION_SKETCHES holds a KMV sketch of every list (count estimates without the postings)
+        const uint64_t FLAG_SKETCHES = 0x8;
+
+        enum Section {
+            SECTION_WEIGHTS = 0,
+            SECTION_DOCUMENT_MAP = 1,
+            SECTION_DIRECTORY = 2,
+            SECTION_SKETCHES = 3,
+            SECTION_COUNT = 8
+        };
+
+        struct Header {
+            uint64_t magic;
+            uint64_t flags;
+            uint64_t feature_count;
+            uint64_t sections[SECTION_COUNT]; // byte offsets of the optional sections, 0 if missing
+        };
+
+        /*
+         * SECTION_DIRECTORY: [feature count][section words][Elias-Fano ids][Elias-Fano list offsets]
+         * The lists are stored back to back, so the offsets (plus the end of the last list) give
+         * the sizes as well. A few bits per feature instead of a 24-byte Entry.
+         */
+        class CompactDirectory {
+        public:
+            static const uint64_t HEADER_WORDS = 2;
+
+            CompactDirectory() = default;
+
+            explicit CompactDirectory(const uint64_t *section) :
+                    ids(section + HEADER_WORDS),
+                    offsets(section + HEADER_WORDS + ids.word_count()) {}
+
+            static std::vector<uint64_t> encode(const std::vector<FeatureId> &ids, const std::vector<uint64_t> &offsets) {
+                auto encoded_ids = compression_helpers::EliasFano::encode(ids);
+                auto encoded_offsets = compression_helpers::EliasFano::encode(offsets);
+
+                std::vector<uint64_t> section{ids.size(), HEADER_WORDS + encoded_ids.size() + encoded_offsets.size()};
+                section.insert(section.end(), encoded_ids.begin(), encoded_ids.end());
+                section.insert(section.end(), encoded_offsets.begin(), encoded_offsets.end());
+                return section;
+            }
+
+            uint64_t size() const {
+                return ids.size();
+            }
+
+            // Position of the feature, size() if it is not stored
+            uint64_t find(FeatureId id) const {
+                uint64_t position = ids.lower_bound(id);
+                return position < ids.size() && ids[position] == id ? position : ids.size();
+            }
+
+            // Byte range (offset, count) of the documents at position
+            std::pair<uint64_t, uint64_t> documents(uint64_t position) const {
+                const uint64_t begin = offsets[position];
+                return std::make_pair(begin, offsets[position + 1] - begin);
+            }
+
+        private:
+            compression_helpers::EliasFano ids;
+            compression_helpers::EliasFano offsets;
+        };
+
+        /*
+         * K minimum values of the hashed document ids of a list. SECTION_SKETCHES:
+         * [k][list count], then [list length][k smallest hashes ascending] of every list
+         * (directory order, hashes behind min(length, k) are padding).
+         */
+        class KmvSketch {
+        public:
+            explicit KmvSketch(uint64_t k) : k(k) {}
+
+            // Bijective 64-bit mix (splitmix64 finalizer) - distinct documents never collide
+            static uint64_t hash(DocumentId document_id) {
+                uint64_t h = document_id + 0x9e3779b97f4a7c15ULL;
+                h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+                return h ^ (h >> 31);
+            }
+
+            void add(DocumentId document_id) {
+                ++length;
+                const uint64_t h = hash(document_id);
+
+                // Max-heap of the k smallest hashes
+                if (smallest.size() < k) {
+                    smallest.push_back(h);
+                    std::push_heap(smallest.begin(), smallest.end());
+                } else if (k && h < smallest.front()) {
+                    std::pop_heap(smallest.begin(), smallest.end());
+                    smallest.back() = h;
+                    std::push_heap(smallest.begin(), smallest.end());
+                }
+            }
+
+            void append_to(std::vector<uint64_t> &section) {
+                std::sort_heap(smallest.begin(), smallest.end());
+                section.push_back(length);
+                section.insert(section.end(), smallest.begin(), smallest.end());
+                section.insert(section.end(), k - smallest.size(), UINT64_MAX);
+            }
+
+        private:
+            const uint64_t k;
+            uint64_t length = 0;
+            std::vector<uint64_t> smallest;
+        };
+
         class Storage {
         public:
             class FeatureDocuments {
             public:
                 FeatureDocuments() = default;
 
-                FeatureDocuments(const Storage *const storage, FeatureId feature_id) : storage(storage),
-                                                                                       feature_id(feature_id) {}
+                FeatureDocuments(const Storage *const storage, FeatureId feature_id) :
+                        weight_bytes(storage->weight_bytes()) {
+                    auto entry = storage->entry(feature_id);
+                    data_begin = storage->get_const_ptr<uint8_t>(entry.document_offset);
+                    data_end = data_begin + entry.count;
+                }
 
-                explicit FeatureDocuments(std::vector<DocumentId> &&vct) : storage(),
-                                                                           feature_id(),
-                                                                           documents_vector(vct) {}
+                // Compressed documents outside of the mapped file, owner keeps the buffer alive
+                FeatureDocuments(const uint8_t *data_begin, const uint8_t *data_end, std::shared_ptr<const void> owner,
+                                 uint8_t weight_bytes = 0) :
+                        data_begin(data_begin),
+                        data_end(data_end),
+                        weight_bytes(weight_bytes),
+                        owner(std::move(owner)) {}
+
+                explicit FeatureDocuments(std::vector<DocumentId> &&vct) : documents_vector(std::move(vct)) {}
+
+                // Decoded documents shared by several users (e.g. the queries of a batch)
+                explicit FeatureDocuments(std::shared_ptr<const std::vector<DocumentId>> shared) :
+                        shared_documents(std::move(shared)) {}
 
                 struct iterator : public std::iterator<
                         std::input_iterator_tag,    // iterator_category
@@ -80,23 +419,29 @@ namespace ii {
                         const DocumentId *,         // pointer
                         const DocumentId &          // reference
                 > {
-                    explicit iterator(const uint8_t *const data_start) : data_ptr(data_start),
-                                                                         last_document_id(0),
-                                                                         buffer_iterator() {
-                        curr_document_id = compression_helpers::get_next(last_document_id, data_ptr);
+                    iterator(const uint8_t *const data_start, const uint8_t *const data_end,
+                             uint8_t weight_bytes = 0) : data_ptr(data_start),
+                                                         data_end(data_end),
+                                                         weight_bytes(weight_bytes),
+                                                         curr_document_id(0),
+                                                                                                last_document_id(0),
+                                                                                                buffer_iterator() {
+                        read_current();
                     }
 
                     explicit iterator(std::vector<DocumentId>::const_iterator &&buffer_iterator) :
                             data_ptr(),
-                            last_document_id(0),
+                            data_end(),
+                            weight_bytes(0),
                             curr_document_id(0),
+                            last_document_id(0),
                             buffer_iterator(buffer_iterator) {}
 
                     iterator &operator++() {
                         if (data_ptr) {
                             last_document_id = curr_document_id;
-                            data_ptr += compression_helpers::get_byte_count(data_ptr);
-                            curr_document_id = compression_helpers::get_next(last_document_id, data_ptr);
+                            data_ptr += compression_helpers::get_byte_count(data_ptr, data_end) + weight_bytes;
+                            read_current();
                         } else {
                             buffer_iterator++;
                         }
@@ -105,13 +450,7 @@ namespace ii {
 
                     const iterator operator++(int) {
                         iterator i = *this;
-                        if (data_ptr) {
-                            last_document_id = curr_document_id;
-                            data_ptr += compression_helpers::get_byte_count(data_ptr);
-                            curr_document_id = compression_helpers::get_next(last_document_id, data_ptr);
-                        } else {
-                            buffer_iterator++;
-                        }
+                        ++(*this);
                         return i;
                     }
 
@@ -128,51 +467,172 @@ namespace ii {
                         return data_ptr != other.data_ptr || buffer_iterator != other.buffer_iterator;
                     }
 
+                    // Position in the compressed documents (null for decoded ones)
+                    const uint8_t *encoded_position() const {
+                        return data_ptr;
+                    }
+
                 private:
+                    // Never decode behind the list (the buffer does not have to continue there)
+                    void read_current() {
+                        if (data_ptr < data_end) {
+                            curr_document_id = compression_helpers::get_next(last_document_id, data_ptr, data_end);
+                        }
+                    }
+
                     const std::uint8_t *data_ptr;
+                    const std::uint8_t *data_end;
+                    uint8_t weight_bytes;
                     DocumentId curr_document_id;
                     DocumentId last_document_id;
                     std::vector<DocumentId>::const_iterator buffer_iterator;
                 };
 
                 iterator begin() const {
-                    if (storage) {
-                        auto *entry = storage->get_const_ptr<Entry>(feature_id);
-                        auto *first_document = storage->get_const_ptr<uint8_t>(entry->document_offset);
-                        return iterator(first_document);
-                    } else {
-                        return iterator(documents_vector.cbegin());
-                    }
+                    if (data_begin) return iterator(data_begin, data_end, weight_bytes);
+                    else if (shared_documents) return iterator(shared_documents->cbegin());
+                    else return iterator(documents_vector.cbegin());
                 }
 
                 iterator end() const {
-                    if (storage) {
-                        auto *entry = storage->get_const_ptr<Entry>(feature_id);
-                        auto *behind_last = storage->get_const_ptr<uint8_t>(entry->document_offset + entry->count);
-                        return iterator(behind_last);
-                    } else {
-                        return iterator(documents_vector.cend());
+                    if (data_begin) return iterator(data_end, data_end, weight_bytes);
+                    else if (shared_documents) return iterator(shared_documents->cend());
+                    else return iterator(documents_vector.cend());
+                }
+
+                // Compressed bytes in front of position (0 for decoded documents)
+                uint64_t encoded_bytes(const iterator &position) const {
+                    return data_begin ? position.encoded_position() - data_begin : 0;
+                }
+
+                uint64_t encoded_bytes() const {
+                    return data_end - data_begin;
+                }
+
+                // Upper bound of the document count (a compressed posting takes at least 1 byte + the weight)
+                uint64_t max_size() const {
+                    if (data_begin) return (data_end - data_begin) / (1 + weight_bytes);
+                    return decoded_count();
+                }
+
+                // Document count without decoding (a posting starts with the only byte without the continuation bit
+                // in its varint, the weight byte has the bit clear as well)
+                uint64_t count() const {
+                    if (!data_begin) return decoded_count();
+
+                    uint64_t starts = 0;
+                    for (auto *b = data_begin; b != data_end; ++b) {
+                        if (!(*b & compression_helpers::BITMASK_HAS_NEXT)) ++starts;
                     }
+                    return starts / (1 + weight_bytes);
+                }
+
+                // Documents of a decoded list (0 for compressed ones)
+                uint64_t decoded_count() const {
+                    if (data_begin) return 0;
+                    return shared_documents ? shared_documents->size() : documents_vector.size();
                 }
 
             private:
-                const Storage *storage = nullptr;
-                FeatureId feature_id = 0;
+                const uint8_t *data_begin = nullptr;
+                const uint8_t *data_end = nullptr;
+                uint8_t weight_bytes = 0;
+                std::shared_ptr<const void> owner;
+                std::shared_ptr<const std::vector<DocumentId>> shared_documents;
                 std::vector<DocumentId> documents_vector;
             };
 
-            explicit Storage(const uint64_t *data_start) : data_ptr(data_start) {}
+            // Directory record of a feature, documents are stored at [document_offset, document_offset + count)
+            struct Entry {
+                FeatureId id;
+                uint64_t count;
+                uint64_t document_offset;
+            };
+
+            explicit Storage(const uint64_t *data_start) : data_ptr(data_start) {
+                if (data_start && *data_start == HEADER_MAGIC) {
+                    header = reinterpret_cast<const Header *>(data_start);
+                    entries_offset = sizeof(Header);
+                }
+                if (header && (header->flags & FLAG_COMPACT_DIRECTORY) && header->sections[SECTION_DIRECTORY]) {
+                    compact_directory = CompactDirectory(section<uint64_t>(SECTION_DIRECTORY));
+                }
+            }
 
             const FeatureDocuments operator[](FeatureId id) const {
                 return FeatureDocuments(this, id);
             }
 
+            // Byte range of the feature's compressed documents
+            std::pair<const void *, uint64_t> documents_range(FeatureId id) const {
+                auto e = entry(id);
+                return std::make_pair(get_const_ptr<uint8_t>(e.document_offset), e.count);
+            }
+
+            // Features missing in a compact directory have no documents
+            Entry entry(FeatureId id) const {
+                if (is_compact()) {
+                    uint64_t position = compact_directory.find(id);
+                    if (position == compact_directory.size()) return Entry{id, 0, 0};
+
+                    auto documents = compact_directory.documents(position);
+                    return Entry{id, documents.second, documents.first};
+                }
+                return reinterpret_cast<const Entry *>(get_const_ptr<uint8_t>(entries_offset))[id];
+            }
+
+            // Position of the feature in the directory (indexes the per-feature tables of the sections),
+            // the feature count if a compact directory does not contain it
+            uint64_t feature_index(FeatureId id) const {
+                return is_compact() ? compact_directory.find(id) : id;
+            }
+
+            // [list length][sketch_size() smallest document hashes] of the feature,
+            // null if the file has no sketches or does not contain the feature
+            const uint64_t *sketch(FeatureId id) const {
+                auto *sketches = section<uint64_t>(SECTION_SKETCHES);
+                if (!sketches) return nullptr;
+
+                const uint64_t index = feature_index(id);
+                if (index >= sketches[1]) return nullptr;
+                return sketches + 2 + index * (1 + sketches[0]);
+            }
+
+            uint64_t sketch_size() const {
+                auto *sketches = section<uint64_t>(SECTION_SKETCHES);
+                return sketches ? sketches[0] : 0;
+            }
+
+            bool is_compact() const {
+                return header && (header->flags & FLAG_COMPACT_DIRECTORY);
+            }
+
+            // Null for plain index files
+            const Header *get_header() const {
+                return header;
+            }
+
+            uint8_t weight_bytes() const {
+                return header && (header->flags & FLAG_WEIGHTED) ? 1 : 0;
+            }
+
+            template<typename T>
+            const T *section(Section s) const {
+                if (!header || !header->sections[s]) return nullptr;
+                return reinterpret_cast<const T *>(get_const_ptr<uint8_t>(header->sections[s]));
+            }
+
+            // Original ids indexed by the stored ids (null if the documents were not reordered)
+            const DocumentId *document_map() const {
+                auto *map_section = section<uint64_t>(SECTION_DOCUMENT_MAP);
+                return map_section ? map_section + 1 : nullptr;
+            }
+
         protected:
-            struct Entry {
-                FeatureId id;
-                uint64_t count;
-                uint64_t document_offset;
-            };
+            // For the Writer - the buffer does not hold an index (yet)
+            struct Unparsed {};
+
+            Storage(const uint64_t *data_start, Unparsed) : data_ptr(data_start) {}
 
             template<typename T>
             const T *get_const_ptr(uint64_t offset) const {
@@ -180,55 +640,214 @@ namespace ii {
             }
 
             const void *data_ptr;
+            const Header *header = nullptr;
+            uint64_t entries_offset = 0;
+            CompactDirectory compact_directory;
         };
 
         class Writer : private Storage {
         public:
-            static uint64_t get_maximum_datafile_size(const uint64_t feature_count, const uint64_t total_data) {
-                return (sizeof(Entry) * feature_count) + (sizeof(DocumentId) * total_data);
+            // Weighted lists are split into blocks of this many postings (block-max upper bounds)
+            static const uint64_t WEIGHT_BLOCK_SIZE = 128;
+
+            // Hashes kept per list by FLAG_SKETCHES (set_sketch_size)
+            static const uint64_t DEFAULT_SKETCH_SIZE = 64;
+
+            // Quantized weights keep the top bit clear (it would read as a varint continuation)
+            static const uint8_t MAX_QUANTIZED_WEIGHT = 0x7F;
+
+            // SECTION_WEIGHTS: ListWeights of every feature followed by the WeightBlocks of all lists
+            struct ListWeights {
+                uint64_t first_block;
+                uint64_t block_count;
+                double max_weight; // weight of the quantized value MAX_QUANTIZED_WEIGHT
+            };
+
+            struct WeightBlock {
+                DocumentId last_document;
+                uint64_t end_offset : 56; // behind the block, relative to the list start
+                uint64_t max_quantized_weight : 8;
+            };
+
+            static uint64_t get_maximum_datafile_size(const uint64_t feature_count, const uint64_t total_data,
+                                                      const uint64_t flags = 0, const uint64_t document_count = 0,
+                                                      const uint64_t sketch_size = DEFAULT_SKETCH_SIZE) {
+                uint64_t size = (sizeof(Entry) * feature_count) + (sizeof(DocumentId) * total_data);
+                if (flags) size += sizeof(Header);
+                // Both Elias-Fano sequences need less than the Entry array (up to 2.2 words per feature)
+                if (flags & FLAG_COMPACT_DIRECTORY) size += sizeof(uint64_t) * 32;
+                if (flags & FLAG_SKETCHES) size += sizeof(uint64_t) * (3 + feature_count * (1 + sketch_size));
+                if (flags & FLAG_REORDERED) size += sizeof(uint64_t) * 2 + sizeof(DocumentId) * document_count;
+                if (flags & FLAG_WEIGHTED) {
+                    size += total_data; // weight bytes
+                    size += sizeof(uint64_t) + sizeof(ListWeights) * feature_count;
+                    size += sizeof(WeightBlock) * (total_data / WEIGHT_BLOCK_SIZE + feature_count);
+                }
+                return size;
             }
 
-            Writer(uint64_t *const data_start, const uint64_t feature_count) :
-                    Storage(data_start),
+            Writer(uint64_t *const data_start, const uint64_t feature_count, const uint64_t flags = 0) :
+                    Storage(data_start, Unparsed()),
                     feature_count(feature_count) {
-                next_document_offset = (feature_count * sizeof(Entry));
+                if (flags) {
+                    auto *h = get_ptr<Header>(0);
+                    *h = Header{HEADER_MAGIC, flags, feature_count, {}};
+                    header = h;
+                    entries_offset = sizeof(Header);
+                }
+                next_entry_offset = entries_offset;
+                next_document_offset = entries_offset;
+                if (!(flags & FLAG_COMPACT_DIRECTORY)) next_document_offset += feature_count * sizeof(Entry);
             }
 
             template<typename IT>
             void persist(const FeatureId id, IT &&documents) {
                 uint64_t total_bits = 0;
                 uint64_t last_document_id = 0;
+                KmvSketch sketch(sketching() ? sketch_size : 0);
 
                 auto *next_data = get_ptr<uint8_t>(next_document_offset);
-                for (DocumentId &&document_id : documents) {
+                for (DocumentId document_id : documents) {
                     auto bit_count = compression_helpers::store_next(last_document_id, document_id, next_data);
+                    if (sketching()) sketch.add(document_id);
 
                     last_document_id = document_id;
                     next_data += bit_count;
                     total_bits += bit_count;
                 }
+                if (sketching()) sketch.append_to(sketch_data);
 
-                unflushed_entries.push_back(Entry{id, total_bits, next_document_offset});
-                if (unflushed_entries.size() > BUFFER_SIZE) flush();
+                add_entry(Entry{id, total_bits, next_document_offset});
+            }
+
+            // Postings are (document id, weight) pairs, the weights get quantized relative to the list maximum
+            template<typename IT>
+            void persist_weighted(const FeatureId id, IT &&postings) {
+                ListWeights list{weight_blocks.size(), 0, 0};
+                for (auto &&posting : postings) {
+                    if (double(posting.second) > list.max_weight) list.max_weight = double(posting.second);
+                }
+
+                uint64_t total_bits = 0;
+                uint64_t last_document_id = 0;
+                uint64_t block_postings = 0;
+                WeightBlock block{0, 0, 0};
+                KmvSketch sketch(sketching() ? sketch_size : 0);
+
+                auto *next_data = get_ptr<uint8_t>(next_document_offset);
+                for (auto &&posting : postings) {
+                    DocumentId document_id = posting.first;
+                    auto bit_count = compression_helpers::store_next(last_document_id, document_id, next_data);
+
+                    uint8_t weight = quantize(double(posting.second), list.max_weight);
+                    next_data[bit_count++] = weight;
+                    if (sketching()) sketch.add(document_id);
+
+                    last_document_id = document_id;
+                    next_data += bit_count;
+                    total_bits += bit_count;
+
+                    // Block bookkeeping
+                    if (weight > block.max_quantized_weight) block.max_quantized_weight = weight;
+                    block.last_document = document_id;
+                    block.end_offset = total_bits;
+                    if (++block_postings == WEIGHT_BLOCK_SIZE) {
+                        weight_blocks.push_back(block);
+                        block = WeightBlock{0, 0, 0};
+                        block_postings = 0;
+                    }
+                }
+                if (block_postings > 0) weight_blocks.push_back(block);
+                if (sketching()) sketch.append_to(sketch_data);
+
+                list.block_count = weight_blocks.size() - list.first_block;
+                list_weights.push_back(list);
 
-                next_document_offset += total_bits;
+                add_entry(Entry{id, total_bits, next_document_offset});
             }
 
             uint64_t get_current_document_size() {
                 return next_document_offset;
             }
 
+            // Writes the directory remainder and the optional sections
+            void finish() {
+                flush();
+
+                if (is_compact()) {
+                    // The end of the last list closes the offsets
+                    directory_offsets.push_back(next_document_offset);
+                    auto directory = CompactDirectory::encode(directory_ids, directory_offsets);
+                    directory_offsets.pop_back();
+
+                    uint64_t offset = begin_section(SECTION_DIRECTORY);
+                    std::copy(directory.begin(), directory.end(), reinterpret_cast<uint64_t *>(get_ptr<uint8_t>(offset)));
+                    next_document_offset = offset + sizeof(uint64_t) * directory.size();
+                }
+
+                if (header && (header->flags & FLAG_WEIGHTED)) {
+                    uint64_t offset = begin_section(SECTION_WEIGHTS);
+
+                    auto *lists = reinterpret_cast<ListWeights *>(get_ptr<uint8_t>(offset));
+                    std::copy(list_weights.begin(), list_weights.end(), lists);
+
+                    auto *blocks = reinterpret_cast<WeightBlock *>(lists + list_weights.size());
+                    std::copy(weight_blocks.begin(), weight_blocks.end(), blocks);
+
+                    next_document_offset = offset + sizeof(ListWeights) * list_weights.size()
+                                           + sizeof(WeightBlock) * weight_blocks.size();
+                }
+
+                if (sketching()) {
+                    uint64_t offset = begin_section(SECTION_SKETCHES);
+
+                    auto *sketch_section = reinterpret_cast<uint64_t *>(get_ptr<uint8_t>(offset));
+                    sketch_section[0] = sketch_size;
+                    sketch_section[1] = sketch_data.size() / (1 + sketch_size);
+                    std::copy(sketch_data.begin(), sketch_data.end(), sketch_section + 2);
+
+                    next_document_offset = offset + sizeof(uint64_t) * (2 + sketch_data.size());
+                }
+
+                if (header && (header->flags & FLAG_REORDERED)) {
+                    uint64_t offset = begin_section(SECTION_DOCUMENT_MAP);
+
+                    auto *map_section = reinterpret_cast<uint64_t *>(get_ptr<uint8_t>(offset));
+                    map_section[0] = original_documents.size();
+                    std::copy(original_documents.begin(), original_documents.end(), map_section + 1);
+
+                    next_document_offset = offset + sizeof(uint64_t) * (1 + original_documents.size());
+                }
+            }
+
+            // Hashes per KMV sketch (FLAG_SKETCHES), set before the first feature is persisted
+            void set_sketch_size(uint64_t size) {
+                if (size < 3) throw std::invalid_argument("sketches need at least 3 hashes");
+                sketch_size = size;
+            }
+
+            // Original document ids indexed by the persisted ids (FLAG_REORDERED)
+            void set_document_map(std::vector<DocumentId> &&original_ids) {
+                original_documents = std::move(original_ids);
+            }
+
             void flush() {
-                auto *next_entry = get_ptr<Entry>(next_entry_offset);
+                auto *next_entry = reinterpret_cast<Entry *>(get_ptr<uint8_t>(next_entry_offset));
 
                 for (Entry &fe : unflushed_entries) {
-                    ++next_entry_offset;
+                    next_entry_offset += sizeof(Entry);
                     *(next_entry++) = fe;
                 }
 
                 unflushed_entries.clear();
             }
 
+            static uint8_t quantize(double weight, double max_weight) {
+                if (max_weight <= 0 || weight <= 0) return 0;
+                double quantized = weight / max_weight * MAX_QUANTIZED_WEIGHT + 0.5;
+                return quantized >= MAX_QUANTIZED_WEIGHT ? MAX_QUANTIZED_WEIGHT : uint8_t(quantized);
+            }
+
         private:
             template<typename T>
             T *get_ptr(uint64_t offset) const {
@@ -236,61 +855,251 @@ namespace ii {
                 return const_cast<T *>(data_ptr);
             }
 
+            bool sketching() const {
+                return header && (header->flags & FLAG_SKETCHES);
+            }
+
+            void add_entry(Entry &&entry) {
+                if (is_compact()) {
+                    if (!directory_ids.empty() && entry.id <= directory_ids.back()) {
+                        throw std::invalid_argument("features of a compact directory must be persisted by increasing id");
+                    }
+                    directory_ids.push_back(entry.id);
+                    directory_offsets.push_back(entry.document_offset);
+                    next_document_offset += entry.count;
+                    return;
+                }
+
+                unflushed_entries.push_back(entry);
+                if (unflushed_entries.size() > BUFFER_SIZE) flush();
+
+                next_document_offset += entry.count;
+            }
+
+            // Sections start 8-byte aligned behind the documents
+            uint64_t begin_section(Section s) {
+                uint64_t offset = (next_document_offset + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+                get_ptr<Header>(0)->sections[s] = offset;
+                return offset;
+            }
+
             const size_t BUFFER_SIZE = 20;
 
             uint64_t feature_count = 0;
             uint64_t next_entry_offset = 0;
             uint64_t next_document_offset = 0;
             std::vector<Entry> unflushed_entries;
+
+            std::vector<ListWeights> list_weights;
+            std::vector<WeightBlock> weight_blocks;
+            std::vector<DocumentId> original_documents;
+
+            std::vector<FeatureId> directory_ids;
+            std::vector<uint64_t> directory_offsets;
+
+            uint64_t sketch_size = DEFAULT_SKETCH_SIZE;
+            std::vector<uint64_t> sketch_data;
+        };
+
+        /*
+         * Buffers recycled across reads and queries; a buffer returns into the pool when its last user
+         * releases it. Buffers grown over max_capacity elements are freed instead (no hoarding).
+         */
+        template<typename T>
+        class BufferPool : public std::enable_shared_from_this<BufferPool<T>> {
+        public:
+            typedef std::vector<T> buffer;
+
+            explicit BufferPool(size_t max_pooled, size_t max_capacity = SIZE_MAX) : max_pooled(max_pooled),
+                                                                                     max_capacity(max_capacity) {}
+
+            // Buffer of size elements
+            std::shared_ptr<buffer> acquire(size_t size) {
+                auto b = take();
+                b->resize(size);
+                return b;
+            }
+
+            // Empty buffer, appending up to capacity elements does not reallocate
+            std::shared_ptr<buffer> acquire_reserved(size_t capacity) {
+                auto b = take();
+                b->clear();
+                b->reserve(capacity);
+                return b;
+            }
+
+            ~BufferPool() {
+                for (auto *b : free_buffers) delete b;
+            }
+
+        private:
+            std::shared_ptr<buffer> take() {
+                buffer *b = nullptr;
+                {
+                    std::lock_guard guard(pool_mutex);
+                    if (!free_buffers.empty()) {
+                        b = free_buffers.back();
+                        free_buffers.pop_back();
+                    }
+                }
+                if (!b) b = new buffer();
+
+                auto pool = this->shared_from_this();
+                return std::shared_ptr<buffer>(b, [pool](buffer *released) { pool->release(released); });
+            }
+
+            void release(buffer *b) {
+                std::lock_guard guard(pool_mutex);
+                if (free_buffers.size() < max_pooled && b->capacity() <= max_capacity) free_buffers.push_back(b);
+                else delete b;
+            }
+
+            const size_t max_pooled;
+            const size_t max_capacity;
+            std::mutex pool_mutex;
+            std::vector<buffer *> free_buffers;
         };
 
         class Processor {
         public:
-            explicit Processor(const Storage &features) : features(features), unprocessed_buffers(0) {}
+            // Work of a single merge (collected only when the query is traced)
+            struct MergeCounters {
+                uint64_t postings_touched = 0;
+                uint64_t bytes_decoded = 0;
+            };
+
+            explicit Processor(const Storage &features, uint32_t max_threads = 8) : features(&features),
+                                                                                     max_threads(max_threads),
+                                                                                     unprocessed_buffers(0) {}
+
+            // Processor for lists not coming from a mapped Storage (see search_async)
+            explicit Processor(uint32_t max_threads = 8) : features(nullptr),
+                                                           max_threads(max_threads),
+                                                           unprocessed_buffers(0) {}
+
+            // Records the next search into stats
+            void trace(search_stats &query_stats) {
+                query_stats = search_stats();
+                stats = &query_stats;
+                start_time = std::chrono::steady_clock::now();
+            }
 
             template<typename FS>
             Storage::FeatureDocuments search(FS &&query_features) {
                 for (auto &&feature_id : query_features) {
-                    processing_queue.push(features[feature_id]);
+                    push_list((*features)[feature_id]);
                     ++unprocessed_buffers;
                 }
 
-                const uint32_t hw_thread_count = std::thread::hardware_concurrency();
-                const uint32_t process_threads = hw_thread_count < 8 ? hw_thread_count : 8;
+                run_workers();
 
-                std::vector<std::thread> workers;
-                for (int i = 0; i < process_threads; ++i)
-                    workers.push_back(std::thread([this]() { main_thread_worker_job(); }));
+                return result();
+            }
 
-                for (auto &t : workers)
-                    t.join();
+            // Size of the intersection, the last merge only counts the documents
+            template<typename FS>
+            uint64_t count(FS &&query_features) {
+                for (auto &&feature_id : query_features) {
+                    push_list((*features)[feature_id]);
+                    ++unprocessed_buffers;
+                }
+                if (processing_queue.empty()) return 0;
+                if (processing_queue.size() == 1) return processing_queue.front().documents.count();
 
-                return processing_queue.front();
+                count_only = true;
+                pending_merges = processing_queue.size() - 1;
+                run_workers();
+
+                if (stats) stats->total_ns = elapsed_ns();
+                return final_count;
             }
 
-        private:
-            const Storage &features;
+            // Intersection of lists prepared by the caller (e.g. cached partial results)
+            Storage::FeatureDocuments search_lists(std::vector<Storage::FeatureDocuments> &&lists) {
+                for (auto &documents : lists) {
+                    push_list(std::move(documents));
+                    ++unprocessed_buffers;
+                }
 
-            std::mutex queue_mutex;
-            std::condition_variable queue_condition_variable;
+                run_workers();
 
-            std::atomic<int32_t> unprocessed_buffers;
-            std::queue<Storage::FeatureDocuments> processing_queue;
+                return result();
+            }
+
+            // The loader gets a push function and hands over the lists as they arrive,
+            // the workers meanwhile merge the lists which are already available
+            template<typename Loader>
+            Storage::FeatureDocuments search_async(uint32_t list_count, Loader &&loader) {
+                unprocessed_buffers = list_count;
+
+                run_workers([&]() {
+                    loader([this](Storage::FeatureDocuments &&documents) { push_buffer(std::move(documents)); });
+                });
+
+                // A single list is not merged => it may still be on its way
+                std::unique_lock lock(queue_mutex);
+                queue_condition_variable.wait(lock, [this]() { return !processing_queue.empty(); });
+                lock.unlock();
+
+                return result();
+            }
+
+            // Intersection of two sorted lists
+            static Storage::FeatureDocuments merge(
+                    const Storage::FeatureDocuments &first,
+                    const Storage::FeatureDocuments &second,
+                    MergeCounters *counters = nullptr
+            ) {
+                // Pooled buffer large enough for the whole result, handed over without a copy
+                auto result_vector = result_buffers()->acquire_reserved(std::min(first.max_size(), second.max_size()));
+                intersect(first, second, counters, [&](DocumentId document_id) { result_vector->push_back(document_id); });
+
+                return Storage::FeatureDocuments(std::shared_ptr<const std::vector<DocumentId>>(std::move(result_vector)));
+            }
+
+            // Size of the intersection of two sorted lists (nothing gets stored)
+            static uint64_t merge_count(
+                    const Storage::FeatureDocuments &first,
+                    const Storage::FeatureDocuments &second,
+                    MergeCounters *counters = nullptr
+            ) {
+                uint64_t count = 0;
+                intersect(first, second, counters, [&](DocumentId) { ++count; });
+                return count;
+            }
+
+            // Intermediate results, recycled across queries
+            static const std::shared_ptr<BufferPool<DocumentId>> &result_buffers() {
+                static const auto pool = std::make_shared<BufferPool<DocumentId>>(64, 1 << 20);
+                return pool;
+            }
+
+            // Merge threads a search actually runs with (max_threads bounded by the hardware)
+            static uint32_t worker_count(uint32_t max_threads) {
+                const uint32_t hw_thread_count = std::thread::hardware_concurrency();
+                uint32_t process_threads = hw_thread_count < max_threads ? hw_thread_count : max_threads;
+                return process_threads == 0 ? 1 : process_threads;
+            }
 
-            Storage::FeatureDocuments merge(
+        private:
+            template<typename OutFn>
+            static void intersect(
                     const Storage::FeatureDocuments &first,
-                    const Storage::FeatureDocuments &second
+                    const Storage::FeatureDocuments &second,
+                    MergeCounters *counters,
+                    OutFn &&output
             ) {
-                std::vector<DocumentId> result_vector;
+                uint64_t postings_touched = 0;
 
                 auto it_first = first.begin();
                 auto it_second = second.begin();
 
                 while (it_first != first.end() && it_second != second.end()) {
+                    ++postings_touched;
 
                     // Equal => result
                     if (*it_first == *it_second) {
-                        result_vector.push_back((*it_first));
+                        output(*it_first);
                         ++it_first;
                         ++it_second;
                     }
@@ -302,13 +1111,92 @@ namespace ii {
                     else if (*it_first > *it_second) ++it_second;
                 }
 
-                return Storage::FeatureDocuments(std::move(result_vector));
+                if (counters) {
+                    counters->postings_touched += postings_touched;
+                    counters->bytes_decoded += first.encoded_bytes(it_first) + second.encoded_bytes(it_second);
+                }
             }
 
-            void main_thread_worker_job() {
+            // List in the queue with its merge tree node (traced queries only)
+            struct QueuedList {
+                Storage::FeatureDocuments documents;
+                uint64_t node;
+            };
+
+            const Storage *features;
+            const uint32_t max_threads;
+
+            std::mutex queue_mutex;
+            std::condition_variable queue_condition_variable;
+
+            std::atomic<int32_t> unprocessed_buffers;
+            std::queue<QueuedList> processing_queue;
+
+            search_stats *stats = nullptr;
+            std::chrono::steady_clock::time_point start_time;
+
+            // count(): the final merge stores its size into final_count instead of a result
+            bool count_only = false;
+            size_t pending_merges = 0; // merges which haven't taken their lists yet (guarded by queue_mutex)
+            uint64_t final_count = 0;
+
+            uint64_t elapsed_ns() const {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start_time).count();
+            }
+
+            Storage::FeatureDocuments result() {
+                if (stats) stats->total_ns = elapsed_ns();
+                return std::move(processing_queue.front().documents);
+            }
+
+            // Queue lock held (or no workers running)
+            void push_list(Storage::FeatureDocuments documents) {
+                uint64_t node = 0;
+                if (stats) {
+                    search_stats::merge_node leaf;
+                    leaf.encoded_bytes = documents.encoded_bytes();
+                    leaf.documents = documents.decoded_count();
+                    leaf.begin_ns = leaf.end_ns = elapsed_ns();
+
+                    node = stats->merge_tree.size();
+                    stats->merge_tree.push_back(leaf);
+                    ++stats->lists;
+                }
+                processing_queue.push(QueuedList{std::move(documents), node});
+            }
+
+            void run_workers(const std::function<void()> &while_running = nullptr) {
+                const uint32_t process_threads = worker_count(max_threads);
+                if (stats) stats->threads = process_threads;
+
+                std::vector<std::thread> workers;
+                for (uint32_t i = 0; i < process_threads; ++i)
+                    workers.push_back(std::thread([this, i]() { main_thread_worker_job(i); }));
+
+                if (while_running) while_running();
+
+                for (auto &t : workers)
+                    t.join();
+            }
+
+            // Notifies under the lock: once a waiter sees the list, search_async may return and destroy
+            // the processor, the pushing thread must not touch it after the unlock
+            void push_buffer(Storage::FeatureDocuments &&documents) {
+                std::lock_guard guard(queue_mutex);
+                push_list(std::move(documents));
+                queue_condition_variable.notify_all();
+            }
+
+            void main_thread_worker_job(uint32_t thread_index) {
+                // Thread-local counters, added to the stats once the worker ends
+                MergeCounters counters;
+                uint64_t merge_ns = 0;
+                uint64_t wait_ns = 0;
+
                 while (true) {
-                    Storage::FeatureDocuments first_buffer;
-                    Storage::FeatureDocuments second_buffer;
+                    QueuedList first_buffer;
+                    QueuedList second_buffer;
 
                     // Each run would want to remove 2 buffers and to add 1 => -1 in total
                     // End the cycle if not enough unprocessed buffers remain (atomic + signed counter !!)
@@ -318,32 +1206,93 @@ namespace ii {
                     std::unique_lock lock(queue_mutex);
 
                     // Wait for more elments
-                    while (processing_queue.size() < 2) queue_condition_variable.wait(lock);
+                    if (processing_queue.size() < 2) {
+                        const uint64_t wait_begin = stats ? elapsed_ns() : 0;
+                        while (processing_queue.size() < 2) queue_condition_variable.wait(lock);
+                        if (stats) wait_ns += elapsed_ns() - wait_begin;
+                    }
 
                     // Get to-merge lists
-                    first_buffer = processing_queue.front();
+                    first_buffer = std::move(processing_queue.front());
                     processing_queue.pop();
 
-                    second_buffer = processing_queue.front();
+                    second_buffer = std::move(processing_queue.front());
                     processing_queue.pop();
 
+                    // The last merge to take its lists gets the last two (nothing else queued or in flight)
+                    const bool final_merge = count_only && --pending_merges == 0;
+
                     // === UNLOCK ===
                     lock.unlock();
 
                     // Process
-                    auto result = merge(first_buffer, second_buffer);
+                    const uint64_t merge_begin = stats ? elapsed_ns() : 0;
+                    const uint64_t touched_before = counters.postings_touched;
+                    Storage::FeatureDocuments result;
+                    uint64_t result_count;
+                    if (final_merge) {
+                        result_count = merge_count(first_buffer.documents, second_buffer.documents,
+                                                   stats ? &counters : nullptr);
+                    } else {
+                        result = merge(first_buffer.documents, second_buffer.documents, stats ? &counters : nullptr);
+                        result_count = result.decoded_count();
+                    }
 
                     // Store
                     {
                         std::lock_guard guard(queue_mutex);
-                        processing_queue.push(std::move(result));
+                        uint64_t node = 0;
+                        if (stats) {
+                            search_stats::merge_node merged;
+                            merged.first = first_buffer.node;
+                            merged.second = second_buffer.node;
+                            merged.documents = result_count;
+                            merged.postings_touched = counters.postings_touched - touched_before;
+                            merged.thread = thread_index;
+                            merged.begin_ns = merge_begin;
+                            merged.end_ns = elapsed_ns();
+                            merge_ns += merged.end_ns - merged.begin_ns;
+
+                            node = stats->merge_tree.size();
+                            stats->merge_tree.push_back(merged);
+                            ++stats->merge_steps;
+                        }
+                        if (final_merge) final_count = result_count;
+                        else processing_queue.push(QueuedList{std::move(result), node});
                     }
                     queue_condition_variable.notify_one();
                 }
+
+                if (stats) {
+                    std::lock_guard guard(queue_mutex);
+                    stats->postings_touched += counters.postings_touched;
+                    stats->bytes_decoded += counters.bytes_decoded;
+                    stats->merge_ns += merge_ns;
+                    stats->wait_ns += wait_ns;
+                }
             }
         };
     }; // namespace
 
+    // Outputs a search result; results of a reordered index are translated back and sorted by the original ids
+    template<typename Documents, typename OutFn>
+    void output_documents(const DocumentId *document_map, const Documents &result, OutFn &&callback) {
+        if (!document_map) {
+            for (auto &&document_id: result) callback(document_id);
+            return;
+        }
+
+        std::vector<DocumentId> original_ids;
+        for (auto &&document_id : result) original_ids.push_back(document_map[document_id]);
+        std::sort(original_ids.begin(), original_ids.end());
+        for (auto document_id : original_ids) callback(document_id);
+    }
+
+    // Storages are sized in 64-bit words
+    inline uint64_t bytes_to_words(uint64_t bytes) {
+        return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    }
+
     template<typename Truncate, typename FeatureObjectLists>
     void create(Truncate &&truncate, FeatureObjectLists &&features) {
 
@@ -355,7 +1304,7 @@ namespace ii {
 
         // Create the data file
         uint64_t data_file_size = Writer::get_maximum_datafile_size(features.size(), total_data);
-        uint64_t *data_file = truncate(data_file_size);
+        uint64_t *data_file = truncate(bytes_to_words(data_file_size));
 
         // Persist the feature data
         Writer writer(data_file, features.size());
@@ -363,10 +1312,60 @@ namespace ii {
         for (FeatureId id = 0; id < features.size(); ++id) {
             writer.persist(id, features[id]);
         }
-        writer.flush();
+        writer.finish();
 
         // Truncate data file to the actual size (drop pre-allocated space)
-        truncate(writer.get_current_document_size());
+        truncate(bytes_to_words(writer.get_current_document_size()));
+    }
+
+    /*
+     * Creates an index with sparse feature ids (e.g. hashed terms): features iterates (feature id, documents)
+     * pairs in any order. The directory is compact (FLAG_COMPACT_DIRECTORY), missing features have no documents.
+     */
+    template<typename Truncate, typename SparseFeatureLists>
+    void create_sparse(Truncate &&truncate, SparseFeatureLists &&features) {
+
+        // Features by id, get data file size
+        std::vector<std::pair<FeatureId, const typename std::decay_t<decltype(*features.begin())>::second_type *>> lists;
+        uint64_t total_data = 0;
+        for (auto &&feature : features) {
+            lists.emplace_back(feature.first, &feature.second);
+            for (auto &&_ : feature.second) ++total_data;
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        // Create the data file
+        uint64_t data_file_size = Writer::get_maximum_datafile_size(lists.size(), total_data, FLAG_COMPACT_DIRECTORY);
+        uint64_t *data_file = truncate(bytes_to_words(data_file_size));
+
+        // Persist the feature data
+        Writer writer(data_file, lists.size(), FLAG_COMPACT_DIRECTORY);
+
+        for (auto &list : lists) {
+            writer.persist(list.first, *list.second);
+        }
+        writer.finish();
+
+        // Truncate data file to the actual size (drop pre-allocated space)
+        truncate(bytes_to_words(writer.get_current_document_size()));
+    }
+
+    /*
+     * Passes the byte ranges of the queried posting lists to advise (e.g. for madvise(MADV_WILLNEED)),
+     * clipped to the segment of size words (a damaged entry must not advise foreign memory)
+     */
+    template<class Fs, class AdviseFn>
+    void prefetch(const uint64_t *segment, size_t size, Fs &&fs, AdviseFn &&advise) {
+        Storage features(segment);
+        const auto *segment_end = reinterpret_cast<const uint8_t *>(segment + size);
+
+        for (auto &&feature_id : fs) {
+            auto range = features.documents_range(feature_id);
+            const auto *begin = static_cast<const uint8_t *>(range.first);
+            if (begin < reinterpret_cast<const uint8_t *>(segment) || begin >= segment_end) continue;
+
+            advise(range.first, std::min<uint64_t>(range.second, segment_end - begin));
+        }
     }
 
     template<class Fs, class OutFn>
@@ -375,7 +1374,30 @@ namespace ii {
         Processor processor(features);
 
         auto result = processor.search(fs);
-        for (auto &&document_id: result) callback(document_id);
+        output_documents(features.document_map(), result, callback);
+    }
+
+    // Number of documents containing all the features (no callback per document)
+    template<class Fs>
+    uint64_t count(const uint64_t *segment, size_t size, Fs &&fs) {
+        Storage features(segment);
+        Processor processor(features);
+
+        return processor.count(fs);
+    }
+
+    // Search recording its decoding, merge and wait statistics and the merge tree into stats
+    template<class Fs, class OutFn>
+    void search(const uint64_t *segment, size_t size, Fs &&fs, OutFn &&callback, search_stats &stats) {
+        Storage features(segment);
+        Processor processor(features);
+        processor.trace(stats);
+
+        auto result = processor.search(fs);
+        output_documents(features.document_map(), result, [&](DocumentId document_id) {
+            ++stats.result_documents;
+            callback(document_id);
+        });
     }
 
 }; //namespace ii
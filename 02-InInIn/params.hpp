@@ -18,6 +18,9 @@ struct generator_params {
 	static uint64_t seed() {
 		return 123;
 	}
+	static double skew() {
+		return 0;
+	}
 	static size_t query_size() {
 		return 10;
 	}
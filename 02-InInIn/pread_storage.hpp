@@ -0,0 +1,278 @@
+#ifndef _ii_pread_storage_hpp
+#define _ii_pread_storage_hpp
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    struct loader_options {
+        // Threads issuing the pread calls
+        uint32_t io_threads = 4;
+
+        // Queued reads closer than this (in bytes) are served by a single pread
+        uint64_t coalesce_gap = 4096;
+
+        // Upper limit of a coalesced read
+        uint64_t max_read_size = 4 << 20;
+
+        // Released read buffers kept for reuse
+        size_t pooled_buffers = 64;
+
+        // Threads merging the loaded lists of a single query
+        uint32_t merge_threads = 8;
+    };
+
+    namespace {
+        // Issues the queued reads in io threads, adjacent queued reads are coalesced into a single pread
+        class PreadLoader {
+        public:
+            typedef std::function<void(const uint8_t *data, std::shared_ptr<const void> owner,
+                                       std::exception_ptr error)> read_callback;
+
+            PreadLoader(int fd, const loader_options &options) :
+                    fd(fd),
+                    options(options),
+                    buffers(std::make_shared<BufferPool<uint8_t>>(options.pooled_buffers)) {
+                for (uint32_t i = 0; i < options.io_threads; ++i)
+                    io_workers.push_back(std::thread([this]() { io_worker_job(); }));
+            }
+
+            ~PreadLoader() {
+                {
+                    std::lock_guard guard(requests_mutex);
+                    stopping = true;
+                }
+                requests_condition_variable.notify_all();
+                for (auto &t : io_workers) t.join();
+            }
+
+            void read(uint64_t offset, uint64_t bytes, read_callback &&done) {
+                {
+                    std::lock_guard guard(requests_mutex);
+                    requests.emplace(offset, request{bytes, std::move(done)});
+                }
+                requests_condition_variable.notify_one();
+            }
+
+        private:
+            struct request {
+                uint64_t bytes;
+                read_callback done;
+            };
+
+            const int fd;
+            const loader_options options;
+            std::shared_ptr<BufferPool<uint8_t>> buffers;
+
+            std::mutex requests_mutex;
+            std::condition_variable requests_condition_variable;
+            bool stopping = false;
+
+            // Pending reads ordered by file offset (neighbours are the coalescing candidates)
+            std::multimap<uint64_t, request> requests;
+            std::vector<std::thread> io_workers;
+
+            void read_fully(uint8_t *target, uint64_t offset, uint64_t bytes) {
+                while (bytes > 0) {
+                    auto count = pread(fd, target, bytes, offset);
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count < 0) throw std::runtime_error(std::string("pread failed: ") + strerror(errno));
+                    if (count == 0) throw std::runtime_error("pread failed: short read (unexpected end of file)");
+
+                    target += count;
+                    offset += count;
+                    bytes -= count;
+                }
+            }
+
+            void io_worker_job() {
+                while (true) {
+                    std::vector<std::pair<uint64_t, request>> batch;
+
+                    // === LOCK ===
+                    std::unique_lock lock(requests_mutex);
+                    requests_condition_variable.wait(lock, [this]() { return stopping || !requests.empty(); });
+                    if (requests.empty()) break;
+
+                    // Take the first pending read and its queued neighbours behind it
+                    auto it = requests.begin();
+                    uint64_t read_begin = it->first;
+                    uint64_t read_end = it->first + it->second.bytes;
+                    do {
+                        read_end = std::max(read_end, it->first + it->second.bytes);
+                        batch.emplace_back(it->first, std::move(it->second));
+                        it = requests.erase(it);
+                    } while (it != requests.end()
+                             && it->first <= read_end + options.coalesce_gap
+                             && it->first + it->second.bytes - read_begin <= options.max_read_size);
+
+                    // === UNLOCK ===
+                    lock.unlock();
+
+                    // Single pread for the whole batch, the lists share the buffer
+                    std::shared_ptr<BufferPool<uint8_t>::buffer> buffer;
+                    std::exception_ptr error;
+                    try {
+                        buffer = buffers->acquire(read_end - read_begin);
+                        read_fully(buffer->data(), read_begin, read_end - read_begin);
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+
+                    for (auto &r : batch) {
+                        const uint8_t *data = error ? nullptr : buffer->data() + (r.first - read_begin);
+                        r.second.done(data, buffer, error);
+                    }
+                }
+            }
+        };
+    } // namespace
+
+    /*
+     * Storage backend for indexes larger than memory: the directory is read at open, the posting
+     * lists of every query are loaded by asynchronous preads into pooled buffers instead of being
+     * page-faulted from a mapping. Lists are merged as soon as they arrive (decoding overlaps I/O).
+     */
+    class pread_storage {
+    public:
+        explicit pread_storage(const std::string &file_name, const loader_options &options = loader_options()) :
+                options(options) {
+            fd = open(file_name.c_str(), O_RDONLY);
+            if (fd < 0) {
+                perror("open");
+                throw std::runtime_error("could not open index file");
+            }
+
+            // Extended files begin with a header, the first documents begin right behind the directory
+            try {
+                Header header;
+                uint64_t entries_offset = 0;
+                if (pread(fd, &header, sizeof(Header), 0) == sizeof(Header) && header.magic == HEADER_MAGIC) {
+                    entries_offset = sizeof(Header);
+                    if (header.flags & FLAG_WEIGHTED) weight_bytes = 1;
+                }
+
+                // Reordered documents - the id translation stays in memory
+                if (entries_offset && header.sections[SECTION_DOCUMENT_MAP]) {
+                    uint64_t document_count;
+                    read_directory(&document_count, header.sections[SECTION_DOCUMENT_MAP], sizeof(uint64_t));
+                    document_map.resize(document_count);
+                    read_directory(document_map.data(), header.sections[SECTION_DOCUMENT_MAP] + sizeof(uint64_t),
+                                   document_count * sizeof(DocumentId));
+                }
+
+                if (entries_offset && (header.flags & FLAG_COMPACT_DIRECTORY)) {
+                    // Compact directories stay compressed in memory
+                    uint64_t directory_header[CompactDirectory::HEADER_WORDS];
+                    read_directory(directory_header, header.sections[SECTION_DIRECTORY], sizeof(directory_header));
+                    compact_section.resize(directory_header[1]);
+                    read_directory(compact_section.data(), header.sections[SECTION_DIRECTORY],
+                                   compact_section.size() * sizeof(uint64_t));
+                    compact_directory = CompactDirectory(compact_section.data());
+                } else {
+                    Storage::Entry first;
+                    read_directory(&first, entries_offset, sizeof(Storage::Entry));
+                    directory.resize((first.document_offset - entries_offset) / sizeof(Storage::Entry));
+                    read_directory(directory.data(), entries_offset, directory.size() * sizeof(Storage::Entry));
+                }
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+
+            loader = std::make_unique<PreadLoader>(fd, options);
+        }
+
+        ~pread_storage() {
+            loader.reset();
+            close(fd);
+        }
+
+        pread_storage(const pread_storage &) = delete;
+
+        pread_storage &operator=(const pread_storage &) = delete;
+
+        uint64_t feature_count() const {
+            return compact_section.empty() ? directory.size() : compact_directory.size();
+        }
+
+        template<class Fs, class OutFn>
+        void search(Fs &&fs, OutFn &&callback) {
+            std::vector<Storage::Entry> query_entries;
+            for (auto &&feature_id : fs) query_entries.push_back(entry(feature_id));
+            if (query_entries.empty()) return;
+
+            std::mutex error_mutex;
+            std::exception_ptr error;
+
+            Processor processor(options.merge_threads);
+            auto result = processor.search_async(query_entries.size(), [&](auto &&push) {
+                for (const auto &entry : query_entries) {
+                    if (entry.count == 0) {
+                        push(Storage::FeatureDocuments(std::vector<DocumentId>()));
+                        continue;
+                    }
+
+                    loader->read(entry.document_offset, entry.count, [&, push, entry, weight_bytes = weight_bytes](
+                            const uint8_t *data, std::shared_ptr<const void> owner, std::exception_ptr read_error
+                    ) {
+                        if (read_error) {
+                            {
+                                std::lock_guard guard(error_mutex);
+                                error = read_error;
+                            }
+                            // The last touch of the search frame - it may be gone once the push returns
+                            push(Storage::FeatureDocuments(std::vector<DocumentId>()));
+                        } else {
+                            push(Storage::FeatureDocuments(data, data + entry.count, std::move(owner),
+                                                           weight_bytes));
+                        }
+                    });
+                }
+            });
+
+            if (error) std::rethrow_exception(error);
+            output_documents(document_map.empty() ? nullptr : document_map.data(), result, callback);
+        }
+
+    private:
+        int fd = -1;
+        uint8_t weight_bytes = 0;
+        const loader_options options;
+        std::vector<Storage::Entry> directory;
+        std::vector<uint64_t> compact_section;
+        CompactDirectory compact_directory;
+        std::vector<DocumentId> document_map;
+        std::unique_ptr<PreadLoader> loader;
+
+        // Features missing in a compact directory have no documents
+        Storage::Entry entry(FeatureId feature_id) const {
+            if (compact_section.empty()) {
+                if (feature_id >= directory.size()) throw std::out_of_range("unknown feature");
+                return directory[feature_id];
+            }
+
+            uint64_t position = compact_directory.find(feature_id);
+            if (position == compact_directory.size()) return Storage::Entry{feature_id, 0, 0};
+
+            auto documents = compact_directory.documents(position);
+            return Storage::Entry{feature_id, documents.second, documents.first};
+        }
+
+        void read_directory(void *target, uint64_t offset, uint64_t bytes) {
+            auto count = pread(fd, target, bytes, offset);
+            if (count != (ssize_t) bytes) throw std::runtime_error("could not read the index directory");
+        }
+    };
+}; // namespace ii
+
+#endif
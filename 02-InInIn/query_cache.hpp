@@ -0,0 +1,260 @@
+#ifndef _ii_query_cache_hpp
+#define _ii_query_cache_hpp
+
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    struct cache_stats {
+        uint64_t hits = 0;          // the whole query was cached
+        uint64_t partial_hits = 0;  // cached results of sub-queries were reused
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    /*
+     * Memory bounded LRU cache of intersection results, keyed by the sorted feature-id set.
+     * Results are stored compressed (same delta encoding as the index file).
+     *
+     * One cache per index: the cache binds to the segment of its first search and gets cleared when
+     * used with another one. An index rebuilt in place (the same mapping) needs an explicit clear().
+     */
+    class query_cache {
+    public:
+        typedef std::vector<FeatureId> key;
+
+        explicit query_cache(size_t memory_budget) : memory_budget(memory_budget) {}
+
+        query_cache(const query_cache &) = delete;
+
+        query_cache &operator=(const query_cache &) = delete;
+
+        cache_stats stats() const {
+            std::lock_guard guard(cache_mutex);
+            return current_stats;
+        }
+
+        void clear() {
+            std::lock_guard guard(cache_mutex);
+            clear_entries();
+        }
+
+        // Binds the cache to the segment, the results of a previous one get dropped
+        void bind(const uint64_t *segment, size_t size) {
+            std::lock_guard guard(cache_mutex);
+            if (segment == bound_segment && size == bound_size) return;
+
+            clear_entries();
+            bound_segment = segment;
+            bound_size = size;
+        }
+
+        /*
+         * Plans the query: returns the cached results to intersect (largest sub-queries first) and
+         * removes the features they cover from uncovered. Empty if nothing cached applies.
+         */
+        std::vector<Storage::FeatureDocuments> plan(const key &query, key &uncovered) {
+            std::vector<Storage::FeatureDocuments> cached_results;
+            uncovered = query;
+
+            std::lock_guard guard(cache_mutex);
+
+            // Exact hit
+            auto exact = index.find(query);
+            if (exact != index.end()) {
+                touch(exact->second);
+                cached_results.push_back(documents(*exact->second));
+                uncovered.clear();
+                ++current_stats.hits;
+                return cached_results;
+            }
+
+            // Cached subsets of the query - only the entries whose smallest feature is in the query qualify
+            // (the feature mask rejects most of them without a set comparison)
+            const uint64_t query_mask = feature_mask(query);
+            std::vector<entry_list::iterator> subsets;
+            for (auto feature_id : query) {
+                auto candidates = by_first_feature.equal_range(feature_id);
+                for (auto candidate = candidates.first; candidate != candidates.second; ++candidate) {
+                    auto it = candidate->second;
+                    if ((it->mask & ~query_mask) != 0) continue;
+                    if (!std::includes(query.begin(), query.end(), it->features.begin(), it->features.end())) continue;
+                    subsets.push_back(it);
+                }
+            }
+
+            // Greedy cover - always take the subset covering the most uncovered features
+            while (!uncovered.empty()) {
+                size_t best_cover = 1;
+                entry_list::iterator best;
+                for (auto &it : subsets) {
+                    size_t cover = covered_count(it->features, uncovered);
+                    if (cover > best_cover) {
+                        best_cover = cover;
+                        best = it;
+                    }
+                }
+                if (best_cover < 2) break;
+
+                touch(best);
+                cached_results.push_back(documents(*best));
+
+                key rest;
+                std::set_difference(uncovered.begin(), uncovered.end(), best->features.begin(), best->features.end(),
+                                    std::back_inserter(rest));
+                uncovered = std::move(rest);
+            }
+
+            if (cached_results.empty()) ++current_stats.misses;
+            else ++current_stats.partial_hits;
+
+            return cached_results;
+        }
+
+        // Stores the (sorted) documents of the query result
+        template<typename Documents>
+        void insert(const key &query, const Documents &documents) {
+            auto data = std::make_shared<std::vector<uint8_t>>();
+            uint64_t last_document_id = 0;
+            uint8_t encoded[10];
+
+            for (auto &&document_id : documents) {
+                auto byte_count = compression_helpers::store_next(last_document_id, document_id, encoded);
+                data->insert(data->end(), encoded, encoded + byte_count);
+                last_document_id = document_id;
+            }
+            data->shrink_to_fit();
+
+            entry e{query, feature_mask(query), std::move(data)};
+            const size_t size = e.size();
+            if (size > memory_budget) return;
+
+            std::lock_guard guard(cache_mutex);
+            if (index.find(query) != index.end()) return;
+
+            entries.push_front(std::move(e));
+            index.emplace(query, entries.begin());
+            by_first_feature.emplace(query.front(), entries.begin());
+            current_stats.bytes += size;
+            ++current_stats.entries;
+
+            // Evict the least recently used
+            while (current_stats.bytes > memory_budget) {
+                auto &victim = entries.back();
+                current_stats.bytes -= victim.size();
+                --current_stats.entries;
+                ++current_stats.evictions;
+
+                index.erase(victim.features);
+                auto same_first = by_first_feature.equal_range(victim.features.front());
+                for (auto it = same_first.first; it != same_first.second; ++it) {
+                    if (&*it->second == &victim) {
+                        by_first_feature.erase(it);
+                        break;
+                    }
+                }
+                entries.pop_back();
+            }
+        }
+
+    private:
+        struct entry {
+            key features;
+            uint64_t mask;
+            std::shared_ptr<const std::vector<uint8_t>> data;
+
+            size_t size() const {
+                return sizeof(entry) + features.size() * sizeof(FeatureId) + data->size();
+            }
+        };
+
+        typedef std::list<entry> entry_list;
+
+        struct key_hash {
+            size_t operator()(const key &k) const {
+                size_t h = k.size();
+                for (auto f : k) h ^= std::hash<FeatureId>()(f) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+                return h;
+            }
+        };
+
+        const size_t memory_budget;
+
+        mutable std::mutex cache_mutex;
+        cache_stats current_stats;
+
+        // Most recently used first
+        entry_list entries;
+        std::unordered_map<key, entry_list::iterator, key_hash> index;
+        std::unordered_multimap<FeatureId, entry_list::iterator> by_first_feature;
+
+        const uint64_t *bound_segment = nullptr;
+        size_t bound_size = 0;
+
+        void clear_entries() {
+            entries.clear();
+            index.clear();
+            by_first_feature.clear();
+            current_stats.entries = 0;
+            current_stats.bytes = 0;
+        }
+
+        static uint64_t feature_mask(const key &features) {
+            uint64_t mask = 0;
+            for (auto f : features) mask |= uint64_t(1) << (f % 64);
+            return mask;
+        }
+
+        static size_t covered_count(const key &features, const key &uncovered) {
+            size_t count = 0;
+            auto it = uncovered.begin();
+            for (auto f : features) {
+                it = std::lower_bound(it, uncovered.end(), f);
+                if (it != uncovered.end() && *it == f) ++count;
+            }
+            return count;
+        }
+
+        void touch(entry_list::iterator it) {
+            entries.splice(entries.begin(), entries, it);
+        }
+
+        static Storage::FeatureDocuments documents(const entry &e) {
+            const uint8_t *begin = e.data->data();
+            return Storage::FeatureDocuments(begin, begin + e.data->size(), e.data);
+        }
+    };
+
+    // Search reusing the cached results of the query (or of its sub-queries), the result gets cached
+    template<class Fs, class OutFn>
+    void search(const uint64_t *segment, size_t size, Fs &&fs, OutFn &&callback, query_cache &cache) {
+        query_cache::key query;
+        for (auto &&feature_id : fs) query.push_back(feature_id);
+        std::sort(query.begin(), query.end());
+        query.erase(std::unique(query.begin(), query.end()), query.end());
+        if (query.empty()) return;
+
+        Storage features(segment);
+        cache.bind(segment, size);
+
+        query_cache::key uncovered;
+        auto lists = cache.plan(query, uncovered);
+        const bool exact_hit = lists.size() == 1 && uncovered.empty();
+        for (auto feature_id : uncovered) lists.push_back(features[feature_id]);
+
+        Processor processor(features);
+        auto result = processor.search_lists(std::move(lists));
+
+        // Single features are the posting lists themselves
+        if (query.size() > 1 && !exact_hit) cache.insert(query, result);
+
+        output_documents(features.document_map(), result, callback);
+    }
+}; // namespace ii
+
+#endif
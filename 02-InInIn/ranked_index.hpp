@@ -0,0 +1,268 @@
+#ifndef _ii_ranked_index_hpp
+#define _ii_ranked_index_hpp
+
+#include <algorithm>
+#include <cfloat>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    namespace {
+        /*
+         * Cursor over a weighted posting list for the block-max WAND traversal. The block table
+         * (last document + maximal weight of every block) allows skipping and bounding the scores
+         * of whole blocks without decoding them.
+         */
+        class WeightedCursor {
+        public:
+            static const DocumentId END = UINT64_MAX;
+
+            WeightedCursor(const Storage &storage, FeatureId feature_id) {
+                auto range = storage.documents_range(feature_id);
+                list_begin = static_cast<const uint8_t *>(range.first);
+                list_end = list_begin + range.second;
+
+                auto *list_weights = storage.section<Writer::ListWeights>(SECTION_WEIGHTS);
+                if (!list_weights) throw std::logic_error("index file has no posting weights");
+
+                position = list_begin;
+
+                // Feature missing in a compact directory
+                const uint64_t feature_index = storage.feature_index(feature_id);
+                if (feature_index >= storage.get_header()->feature_count) return;
+
+                auto &list = list_weights[feature_index];
+                auto *all_blocks = reinterpret_cast<const Writer::WeightBlock *>(
+                        list_weights + storage.get_header()->feature_count);
+                blocks = all_blocks + list.first_block;
+                block_count = list.block_count;
+                score_scale = list.max_weight / Writer::MAX_QUANTIZED_WEIGHT;
+
+                for (uint64_t b = 0; b < block_count; ++b) {
+                    upper_bound = std::max(upper_bound, blocks[b].max_quantized_weight * score_scale);
+                }
+
+                read_current();
+            }
+
+            DocumentId document() const { return current_document; }
+
+            double score() const { return current_weight * score_scale; }
+
+            // Maximal score of the whole list
+            double max_score() const { return upper_bound; }
+
+            void next() {
+                position += varint_bytes + 1;
+                if (block_index < block_count && position - list_begin >= (int64_t) blocks[block_index].end_offset) {
+                    ++block_index;
+                }
+                last_document = current_document;
+                read_current();
+            }
+
+            // Moves to the first document >= target, whole blocks in front of it are skipped
+            void next_geq(DocumentId target) {
+                if (current_document >= target) return;
+
+                uint64_t b = find_block(block_index, target);
+                if (b == block_count) {
+                    position = list_end;
+                    current_document = END;
+                    return;
+                }
+                if (b != block_index) {
+                    block_index = b;
+                    position = list_begin + blocks[b - 1].end_offset;
+                    last_document = blocks[b - 1].last_document;
+                    read_current();
+                }
+
+                while (current_document < target) next();
+            }
+
+            // Score bound of the block which would contain target (nothing gets decoded)
+            double block_max_score(DocumentId target) {
+                shallow_block = find_block(std::max(shallow_block, block_index), target);
+                if (shallow_block == block_count) return 0;
+                return blocks[shallow_block].max_quantized_weight * score_scale;
+            }
+
+            // Last document of the block which would contain target
+            DocumentId block_last_document(DocumentId target) {
+                shallow_block = find_block(std::max(shallow_block, block_index), target);
+                if (shallow_block == block_count) return END;
+                return blocks[shallow_block].last_document;
+            }
+
+        private:
+            const uint8_t *list_begin = nullptr;
+            const uint8_t *list_end = nullptr;
+            const uint8_t *position = nullptr;
+
+            const Writer::WeightBlock *blocks = nullptr;
+            uint64_t block_count = 0;
+            uint64_t block_index = 0;
+            uint64_t shallow_block = 0;
+
+            double score_scale = 0;
+            double upper_bound = 0;
+
+            DocumentId last_document = 0;
+            DocumentId current_document = END;
+            uint8_t current_weight = 0;
+            uint64_t varint_bytes = 0;
+
+            uint64_t find_block(uint64_t from, DocumentId target) const {
+                // Blocks are ordered by their last document
+                auto *found = std::lower_bound(blocks + from, blocks + block_count, target,
+                                               [](const Writer::WeightBlock &block, DocumentId d) {
+                                                   return block.last_document < d;
+                                               });
+                return found - blocks;
+            }
+
+            void read_current() {
+                if (position >= list_end) {
+                    current_document = END;
+                    return;
+                }
+                varint_bytes = compression_helpers::get_byte_count(position, list_end);
+                current_document = compression_helpers::get_next(last_document, position, list_end);
+                current_weight = position[varint_bytes];
+            }
+        };
+    } // namespace
+
+    /*
+     * Creates an index with a weight per posting, features[i] iterates (document id, weight) pairs.
+     * Weights are quantized to 7 bits per list and stored behind the document deltas, the block
+     * maxima for the top-k search go into SECTION_WEIGHTS. Plain ii::search works on it as well.
+     */
+    template<typename Truncate, typename FeatureObjectLists>
+    void create_weighted(Truncate &&truncate, FeatureObjectLists &&features) {
+
+        // Get data file size
+        uint64_t total_data = 0;
+        for (uint64_t i = 0; i < features.size(); ++i) {
+            for (auto &&_ : features[i]) ++total_data;
+        }
+
+        // Create the data file
+        uint64_t data_file_size = Writer::get_maximum_datafile_size(features.size(), total_data, FLAG_WEIGHTED);
+        uint64_t *data_file = truncate(bytes_to_words(data_file_size));
+
+        // Persist the feature data
+        Writer writer(data_file, features.size(), FLAG_WEIGHTED);
+
+        for (FeatureId id = 0; id < features.size(); ++id) {
+            writer.persist_weighted(id, features[id]);
+        }
+        writer.finish();
+
+        // Truncate data file to the actual size (drop pre-allocated space)
+        truncate(bytes_to_words(writer.get_current_document_size()));
+    }
+
+    /*
+     * Disjunctive top-k search by block-max WAND: callback(document_id, score) gets the k documents
+     * with the highest sum of the query features' weights, best first.
+     */
+    template<class Fs, class OutFn>
+    void search_top_k(const uint64_t *segment, size_t size, Fs &&fs, size_t k, OutFn &&callback) {
+        Storage features(segment);
+        if (k == 0) return;
+
+        std::vector<WeightedCursor> cursor_storage;
+        for (auto &&feature_id : fs) cursor_storage.emplace_back(features, feature_id);
+
+        std::vector<WeightedCursor *> cursors;
+        for (auto &c : cursor_storage) cursors.push_back(&c);
+
+        auto by_document = [](const WeightedCursor *a, const WeightedCursor *b) {
+            return a->document() < b->document();
+        };
+
+        // Min-heap of the best k (score, document)
+        typedef std::pair<double, DocumentId> result;
+        auto worse = [](const result &a, const result &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        };
+        std::vector<result> heap;
+        auto threshold = [&]() { return heap.size() < k ? -DBL_MAX : heap.front().first; };
+
+        // Moves the cursor with the best bound among [0, last] forward
+        auto advance_best = [&](size_t last, DocumentId target) {
+            size_t best = last + 1;
+            for (size_t i = 0; i <= last; ++i) {
+                if (cursors[i]->document() >= target) continue;
+                if (best > last || cursors[i]->max_score() > cursors[best]->max_score()) best = i;
+            }
+            if (best > last) throw std::logic_error("no cursor to advance");
+            cursors[best]->next_geq(target);
+        };
+
+        while (true) {
+            std::sort(cursors.begin(), cursors.end(), by_document);
+
+            // Pivot - the first document whose list bounds could beat the threshold
+            double upper = 0;
+            size_t pivot = cursors.size();
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (cursors[i]->document() == WeightedCursor::END) break;
+                upper += cursors[i]->max_score();
+                if (upper > threshold()) {
+                    pivot = i;
+                    break;
+                }
+            }
+            if (pivot == cursors.size()) break;
+
+            const DocumentId pivot_document = cursors[pivot]->document();
+            while (pivot + 1 < cursors.size() && cursors[pivot + 1]->document() == pivot_document) ++pivot;
+
+            // Refine by the block maxima
+            double block_upper = 0;
+            for (size_t i = 0; i <= pivot; ++i) block_upper += cursors[i]->block_max_score(pivot_document);
+
+            if (block_upper > threshold()) {
+                if (cursors[0]->document() == pivot_document) {
+                    // Evaluate
+                    double score = 0;
+                    for (size_t i = 0; i <= pivot; ++i) {
+                        score += cursors[i]->score();
+                        cursors[i]->next();
+                    }
+
+                    if (score > threshold()) {
+                        if (heap.size() == k) {
+                            std::pop_heap(heap.begin(), heap.end(), worse);
+                            heap.pop_back();
+                        }
+                        heap.emplace_back(score, pivot_document);
+                        std::push_heap(heap.begin(), heap.end(), worse);
+                    }
+                } else {
+                    advance_best(pivot, pivot_document);
+                }
+            } else {
+                // No document up to the end of the current blocks can make it
+                DocumentId next_document = WeightedCursor::END;
+                for (size_t i = 0; i <= pivot; ++i) {
+                    auto block_end = cursors[i]->block_last_document(pivot_document);
+                    if (block_end != WeightedCursor::END) next_document = std::min(next_document, block_end + 1);
+                }
+                if (pivot + 1 < cursors.size()) next_document = std::min(next_document, cursors[pivot + 1]->document());
+
+                advance_best(pivot, next_document);
+            }
+        }
+
+        std::sort_heap(heap.begin(), heap.end(), worse);
+
+        auto *document_map = features.document_map();
+        for (auto &r : heap) callback(document_map ? document_map[r.second] : r.second, r.first);
+    }
+}; // namespace ii
+
+#endif
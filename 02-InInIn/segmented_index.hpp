@@ -0,0 +1,343 @@
+#ifndef _ii_segmented_index_hpp
+#define _ii_segmented_index_hpp
+
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    struct merge_policy {
+        // Merge as soon as this many adjacent segments share a size tier
+        size_t segments_per_tier = 4;
+
+        // Upper limit of segments compacted by a single merge
+        size_t max_merge_segments = 16;
+    };
+
+    namespace {
+        // Feature lists of several segments, concatenated in doc-id order (used as an ii::create input)
+        class ConcatenatedFeatures {
+        public:
+            class documents {
+            public:
+                struct iterator {
+                    iterator(const std::vector<Storage::FeatureDocuments> *lists, size_t list_index) :
+                            lists(lists),
+                            list_index(list_index),
+                            current(list_begin(lists, list_index)) {
+                        skip_empty();
+                    }
+
+                    DocumentId operator*() const {
+                        return *current;
+                    }
+
+                    iterator &operator++() {
+                        ++current;
+                        skip_empty();
+                        return *this;
+                    }
+
+                    bool operator==(const iterator &other) const {
+                        return list_index == other.list_index;
+                    }
+
+                    bool operator!=(const iterator &other) const {
+                        return list_index != other.list_index;
+                    }
+
+                private:
+                    static Storage::FeatureDocuments::iterator list_begin(
+                            const std::vector<Storage::FeatureDocuments> *lists,
+                            size_t list_index
+                    ) {
+                        if (list_index < lists->size()) return (*lists)[list_index].begin();
+                        return Storage::FeatureDocuments::iterator(std::vector<DocumentId>::const_iterator());
+                    }
+
+                    void skip_empty() {
+                        while (list_index < lists->size() && current == (*lists)[list_index].end()) {
+                            if (++list_index < lists->size()) current = (*lists)[list_index].begin();
+                        }
+                    }
+
+                    const std::vector<Storage::FeatureDocuments> *lists;
+                    size_t list_index;
+                    Storage::FeatureDocuments::iterator current;
+                };
+
+                explicit documents(std::vector<Storage::FeatureDocuments> &&lists) : lists(std::move(lists)) {}
+
+                iterator begin() const { return iterator(&lists, 0); }
+
+                iterator end() const { return iterator(&lists, lists.size()); }
+
+            private:
+                std::vector<Storage::FeatureDocuments> lists;
+            };
+
+            void add(const uint64_t *data_start, uint64_t feature_count) {
+                storages.emplace_back(data_start);
+                feature_counts.push_back(feature_count);
+                if (feature_count > max_feature_count) max_feature_count = feature_count;
+            }
+
+            documents operator[](FeatureId feature_id) const {
+                std::vector<Storage::FeatureDocuments> lists;
+                for (size_t i = 0; i < storages.size(); ++i) {
+                    if (feature_id < feature_counts[i]) lists.push_back(storages[i][feature_id]);
+                }
+                return documents(std::move(lists));
+            }
+
+            uint64_t size() const {
+                return max_feature_count;
+            }
+
+        private:
+            std::deque<Storage> storages;
+            std::vector<uint64_t> feature_counts;
+            uint64_t max_feature_count = 0;
+        };
+    } // namespace
+
+    /*
+     * LSM-style index: every append writes a new immutable segment (in the ii::create format),
+     * a background thread compacts adjacent segments of a similar size into larger ones.
+     *
+     * Documents have to be appended in increasing id order - segments then cover disjoint
+     * doc-id ranges and the results are concatenated segment by segment.
+     *
+     * S is a storage in the sense of ii::create (data(), size(), operator()(size_t), drop()).
+     */
+    template<typename S>
+    class segmented_index {
+    public:
+        typedef std::function<std::unique_ptr<S>(uint64_t generation)> segment_factory;
+
+        explicit segmented_index(segment_factory factory, merge_policy policy = merge_policy()) :
+                factory(std::move(factory)),
+                policy(policy),
+                segments(std::make_shared<segment_list>()) {
+            if (this->policy.segments_per_tier < 2) throw std::invalid_argument("segments_per_tier must be at least 2");
+            merger = std::thread([this]() { merger_job(); });
+        }
+
+        ~segmented_index() {
+            {
+                std::lock_guard guard(merge_mutex);
+                stopping = true;
+            }
+            merge_condition_variable.notify_all();
+            merger.join();
+        }
+
+        segmented_index(const segmented_index &) = delete;
+
+        segmented_index &operator=(const segmented_index &) = delete;
+
+        template<typename FeatureObjectLists>
+        void append(FeatureObjectLists &&features) {
+            auto new_segment = std::make_shared<segment>();
+
+            // Doc-id range of the new segment
+            for (uint64_t i = 0; i < features.size(); ++i) {
+                for (auto &&document_id : features[i]) {
+                    if (document_id < new_segment->min_document) new_segment->min_document = document_id;
+                    if (document_id > new_segment->max_document) new_segment->max_document = document_id;
+                    ++new_segment->posting_count;
+                }
+            }
+            if (new_segment->posting_count == 0) return;
+
+            std::lock_guard append_guard(append_mutex);
+            {
+                std::lock_guard guard(segments_mutex);
+                if (!segments->empty() && segments->back()->max_document >= new_segment->min_document) {
+                    throw std::invalid_argument("documents have to be appended in increasing id order");
+                }
+            }
+
+            new_segment->feature_count = features.size();
+            new_segment->storage = factory(next_generation++);
+            ii::create(*new_segment->storage, features);
+
+            publish([&](segment_list &list) { list.push_back(new_segment); });
+            wake_merger();
+        }
+
+        template<class Fs, class OutFn>
+        void search(Fs &&fs, OutFn &&callback) const {
+            std::vector<FeatureId> query_features;
+            for (auto &&feature_id : fs) query_features.push_back(feature_id);
+            if (query_features.empty()) return;
+
+            auto current_segments = snapshot();
+            for (auto &s : *current_segments) {
+                bool has_all_features = true;
+                for (auto feature_id : query_features) {
+                    if (feature_id >= s->feature_count) has_all_features = false;
+                }
+                if (!has_all_features) continue;
+
+                Storage features(s->storage->data());
+                Processor processor(features);
+
+                auto result = processor.search(query_features);
+                for (auto &&document_id: result) callback(document_id);
+            }
+        }
+
+        size_t segment_count() const {
+            return snapshot()->size();
+        }
+
+        // Blocks until the merge policy has nothing left to compact
+        void wait_for_merges() {
+            std::unique_lock lock(merge_mutex);
+            merge_condition_variable.notify_all();
+            idle_condition_variable.wait(lock, [this]() { return merger_idle && !find_merge_run(*snapshot()).second; });
+        }
+
+    private:
+        struct segment {
+            std::unique_ptr<S> storage;
+            uint64_t feature_count = 0;
+            uint64_t posting_count = 0;
+            DocumentId min_document = UINT64_MAX;
+            DocumentId max_document = 0;
+
+            // Merged-away segments drop their data once the last reader releases them
+            std::atomic<bool> retired{false};
+
+            ~segment() {
+                if (retired && storage) storage->drop();
+            }
+        };
+
+        typedef std::vector<std::shared_ptr<segment>> segment_list;
+
+        segment_factory factory;
+        const merge_policy policy;
+
+        // Readers take a reference to the current list, writers publish a modified copy
+        mutable std::mutex segments_mutex;
+        std::shared_ptr<const segment_list> segments;
+
+        std::mutex append_mutex;
+        uint64_t next_generation = 0;
+
+        std::thread merger;
+        std::mutex merge_mutex;
+        std::condition_variable merge_condition_variable;
+        std::condition_variable idle_condition_variable;
+        bool merger_idle = true;
+        bool stopping = false;
+
+        std::shared_ptr<const segment_list> snapshot() const {
+            std::lock_guard guard(segments_mutex);
+            return segments;
+        }
+
+        template<typename Modify>
+        void publish(Modify &&modify) {
+            std::lock_guard guard(segments_mutex);
+            auto modified = std::make_shared<segment_list>(*segments);
+            modify(*modified);
+            segments = std::move(modified);
+        }
+
+        void wake_merger() {
+            // Taking the lock orders the wake-up after the merger's check of the segment list
+            { std::lock_guard guard(merge_mutex); }
+            merge_condition_variable.notify_one();
+        }
+
+        static size_t tier(uint64_t posting_count, size_t segments_per_tier) {
+            size_t result = 0;
+            while (posting_count >= segments_per_tier) {
+                posting_count /= segments_per_tier;
+                ++result;
+            }
+            return result;
+        }
+
+        // First run of adjacent segments within the same tier, long enough to be merged (start, length)
+        std::pair<size_t, size_t> find_merge_run(const segment_list &list) const {
+            size_t run_start = 0;
+            for (size_t i = 1; i <= list.size(); ++i) {
+                bool run_continues = i < list.size()
+                                     && tier(list[i]->posting_count, policy.segments_per_tier)
+                                        == tier(list[run_start]->posting_count, policy.segments_per_tier);
+                if (run_continues) continue;
+
+                size_t run_length = i - run_start;
+                if (run_length >= policy.segments_per_tier) {
+                    return std::make_pair(run_start, std::min(run_length, policy.max_merge_segments));
+                }
+                run_start = i;
+            }
+            return std::make_pair(0, 0);
+        }
+
+        void merge(const segment_list &run) {
+            ConcatenatedFeatures features;
+            auto merged = std::make_shared<segment>();
+
+            for (auto &s : run) {
+                features.add(s->storage->data(), s->feature_count);
+                merged->posting_count += s->posting_count;
+                if (s->min_document < merged->min_document) merged->min_document = s->min_document;
+                if (s->max_document > merged->max_document) merged->max_document = s->max_document;
+            }
+            merged->feature_count = features.size();
+
+            {
+                std::lock_guard append_guard(append_mutex);
+                merged->storage = factory(next_generation++);
+            }
+            ii::create(*merged->storage, features);
+
+            // Replace the run by the merged segment (appends only push back, the run stays in place)
+            publish([&](segment_list &list) {
+                auto first = std::find(list.begin(), list.end(), run.front());
+                list.insert(list.erase(first, first + run.size()), merged);
+            });
+
+            for (auto &s : run) s->retired = true;
+        }
+
+        void merger_job() {
+            std::unique_lock lock(merge_mutex);
+            while (true) {
+                if (stopping) break;
+
+                auto current_segments = snapshot();
+                auto run = find_merge_run(*current_segments);
+                if (run.second == 0) {
+                    merger_idle = true;
+                    idle_condition_variable.notify_all();
+                    merge_condition_variable.wait(lock);
+                    continue;
+                }
+
+                // === UNLOCK === (merging does not block appends nor readers)
+                merger_idle = false;
+                lock.unlock();
+
+                segment_list merge_run(current_segments->begin() + run.first,
+                                       current_segments->begin() + run.first + run.second);
+                merge(merge_run);
+
+                lock.lock();
+            }
+        }
+    };
+}; // namespace ii
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _ii_sharded_index_hpp
+#define _ii_sharded_index_hpp
+
+#include <vector>
+#include <algorithm>
+#include <future>
+#include <stdexcept>
+
+#include "inverted_index.hpp"
+
+namespace ii {
+    namespace {
+        // Feature lists of one shard, filled list by list (all the lists in a single array)
+        class ShardLists {
+        public:
+            class documents {
+            public:
+                documents(const DocumentId *first, const DocumentId *last) : first(first), last(last) {}
+
+                const DocumentId *begin() const {
+                    return first;
+                }
+
+                const DocumentId *end() const {
+                    return last;
+                }
+
+            private:
+                const DocumentId *first;
+                const DocumentId *last;
+            };
+
+            void add(DocumentId document_id) {
+                document_ids.push_back(document_id);
+            }
+
+            // Closes the list of the next feature
+            void end_list() {
+                offsets.push_back(document_ids.size());
+            }
+
+            documents operator[](FeatureId feature_id) const {
+                return documents(document_ids.data() + offsets[feature_id], document_ids.data() + offsets[feature_id + 1]);
+            }
+
+            uint64_t size() const {
+                return offsets.size() - 1;
+            }
+
+        private:
+            std::vector<uint64_t> offsets{0};
+            std::vector<DocumentId> document_ids;
+        };
+    } // namespace
+
+    /*
+     * Partitions the documents by id range into shards.size() independent index files,
+     * shard i holds the documents in [boundaries[i], boundaries[i + 1]).
+     *
+     * Returns the boundaries (shards.size() + 1 values, the last one behind the largest document id).
+     */
+    template<typename Shards, typename FeatureObjectLists>
+    std::vector<DocumentId> create_sharded(Shards &&shards, FeatureObjectLists &&features) {
+        if (shards.size() == 0) throw std::invalid_argument("at least one shard is required");
+
+        // Get the document id range
+        DocumentId max_document = 0;
+        for (uint64_t i = 0; i < features.size(); ++i) {
+            for (auto &&document_id : features[i]) {
+                if (document_id > max_document) max_document = document_id;
+            }
+        }
+
+        // Evenly sized id ranges
+        std::vector<DocumentId> boundaries;
+        const uint64_t shard_range = max_document / shards.size() + 1;
+        for (uint64_t i = 0; i < shards.size(); ++i) boundaries.push_back(i * shard_range);
+        boundaries.push_back(max_document + 1);
+
+        // Partition every list once (sorted => the shards get sorted lists too)
+        std::vector<ShardLists> shard_lists(shards.size());
+        for (uint64_t i = 0; i < features.size(); ++i) {
+            for (auto &&document_id : features[i]) shard_lists[document_id / shard_range].add(document_id);
+            for (auto &lists : shard_lists) lists.end_list();
+        }
+
+        // Persist the shards in parallel
+        std::vector<std::future<void>> shard_builds;
+        for (uint64_t i = 0; i < shards.size(); ++i) {
+            shard_builds.push_back(std::async(std::launch::async, [&, i]() {
+                ii::create(shards[i], shard_lists[i]);
+            }));
+        }
+        for (auto &b : shard_builds) b.get();
+
+        return boundaries;
+    }
+
+    /*
+     * Searches every shard by its own Processor in parallel and outputs the results shard by shard,
+     * i.e. still ordered by document id. Shards are the data pointers of the create_sharded files.
+     */
+    template<class Shards, class Fs, class OutFn>
+    void search_sharded(Shards &&shards, Fs &&fs, OutFn &&callback) {
+        std::vector<FeatureId> query_features;
+        for (auto &&feature_id : fs) query_features.push_back(feature_id);
+        if (query_features.empty() || shards.size() == 0) return;
+
+        // Split the hardware threads among the shards
+        const uint32_t hw_thread_count = std::thread::hardware_concurrency();
+        const uint32_t shard_threads = std::max<uint32_t>(1, hw_thread_count / shards.size());
+
+        std::vector<std::future<std::vector<DocumentId>>> shard_results;
+        for (auto &&shard : shards) {
+            const uint64_t *segment = shard;
+            shard_results.push_back(std::async(std::launch::async, [segment, shard_threads, &query_features]() {
+                Storage features(segment);
+                Processor processor(features, shard_threads);
+
+                auto result = processor.search(query_features);
+                return std::vector<DocumentId>(result.begin(), result.end());
+            }));
+        }
+
+        // Lower shards get output while the higher ones are still processed
+        for (auto &r : shard_results) {
+            for (auto &&document_id : r.get()) callback(document_id);
+        }
+    }
+}; // namespace ii
+
+#endif
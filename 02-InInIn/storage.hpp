@@ -0,0 +1,177 @@
+#ifndef _ii_storage_hpp
+#define _ii_storage_hpp
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Toy implementation of storage, use for testing on small data on Windows.
+ * The memory-mapped storage is compatible with this.
+ */
+class storage {
+    std::vector<uint64_t> d;
+public:
+    uint64_t *data() {
+        return d.data();
+    }
+
+    size_t size() const {
+        return d.size();
+    }
+
+    void drop() {
+        d.clear();
+    }
+
+    uint64_t *operator()(size_t s) {
+        d.resize(s);
+        return data();
+    }
+};
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+/*
+ * Real implementation of memory-mapped storage used in ReCodex, usuable on
+ * Unixes and probably on MinGW/CygWin.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+class disk_storage {
+public:
+    // Open mode flags
+    static const unsigned read_write = 0;
+    static const unsigned read_only = 1;   // O_RDONLY + PROT_READ, the mapping can be shared by processes
+    static const unsigned populate = 2;    // prefault the whole file on mapping (MAP_POPULATE)
+    static const unsigned huge_pages = 4;  // advise transparent huge pages for the mapping
+
+private:
+    std::string file_name;
+    int fd;
+    uint64_t *d;
+    size_t s;
+    unsigned mode;
+
+    void check_writable() const {
+        if (mode & read_only) throw std::logic_error("index file opened read-only");
+    }
+
+    void resize(size_t size) {
+        ftruncate(fd, size * sizeof(uint64_t));
+        s = size;
+    }
+
+    void map() {
+        if (!s) {
+            d = 0;
+            return;
+        }
+        int prot = (mode & read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (mode & populate) flags |= MAP_POPULATE;
+#endif
+        d = (uint64_t *) mmap(nullptr,
+                              s * sizeof(uint64_t),
+                              prot,
+                              flags,
+                              fd,
+                              0);
+        if (d == (void *) -1) {
+            perror("mmap");
+            throw std::runtime_error("mmap failed");
+        }
+#ifdef MADV_HUGEPAGE
+        // Only a hint (not supported by every file system) => errors are ignored
+        if (mode & huge_pages) madvise(d, s * sizeof(uint64_t), MADV_HUGEPAGE);
+#endif
+    }
+
+    void unmap() {
+        if (s && munmap(d, s * sizeof(uint64_t))) {
+            perror("munmap");
+            throw std::runtime_error("munmap failed");
+        }
+    }
+
+public:
+    uint64_t *data() {
+        return d;
+    }
+
+    size_t size() const {
+        return s;
+    }
+
+    // Drops the data and deletes the file (the storage stays usable until destroyed)
+    void drop() {
+        check_writable();
+        unmap();
+        resize(0);
+        map();
+        if (unlink(file_name.c_str())) perror("unlink");
+    }
+
+    uint64_t *operator()(size_t s) {
+        check_writable();
+        unmap();
+        resize(s);
+        map();
+        return d;
+    }
+
+    // Read-ahead hint for a byte range of the mapping (e.g. the posting lists of a query)
+    void will_need(const void *begin, size_t bytes) const {
+        if (!s || !bytes) return;
+
+        // madvise requires a page aligned start
+        const auto page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+        auto start = (uintptr_t) begin & ~(page_size - 1);
+        auto end = std::min((uintptr_t) begin + bytes, (uintptr_t) d + s * sizeof(uint64_t));
+        if (end > start) madvise((void *) start, end - start, MADV_WILLNEED);
+    }
+
+    disk_storage(const std::string &fn, unsigned mode = read_write) : file_name(fn), mode(mode) {
+        if (mode & read_only) fd = open(fn.c_str(), O_RDONLY);
+        else fd = open(fn.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            perror("open");
+            throw std::runtime_error("could not open index file");
+        }
+        struct stat st;
+        if (fstat(fd, &st)) {
+            perror("stat");
+            throw std::runtime_error("could not stat() the index file");
+        }
+        s = st.st_size / sizeof(uint64_t);
+        map();
+    }
+
+    ~disk_storage() {
+        unmap();
+        close(fd);
+    }
+
+    disk_storage(const disk_storage &) = delete;
+
+    disk_storage &operator=(const disk_storage &) = delete;
+
+    disk_storage(disk_storage &&) = delete;
+
+    disk_storage &operator=(disk_storage &&) = delete;
+};
+
+#else
+#define primitive_storage
+#endif
+
+#endif
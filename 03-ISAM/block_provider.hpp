@@ -1,42 +1,412 @@
 #pragma once
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <memory>
+#include <string>
 #include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+
+#include <unistd.h>
+#include <fcntl.h>
 
 namespace block_provider
 {
-	size_t last_block_id_ = 1, read_count_ = 0, block_in_memory_ = 0;
+	size_t last_block_id_ = 1;
+	std::atomic<size_t> read_count_{ 0 }, block_in_memory_{ 0 };
 	std::unordered_map<size_t, void*> blocks_;
 
+	// Blocks pointing into memory owned by someone else (a mapped file), not freed here
+	std::unordered_set<size_t> mapped_;
+
+	// Shared: lookups of blocks_; exclusive: changes of blocks_ and every page file call (pins, CLOCK)
+	std::shared_mutex mutex_;
+
+	struct pool_statistics
+	{
+		size_t hits = 0;        // loads of a resident page
+		size_t misses = 0;      // loads reading the page from the file
+		size_t evictions = 0;   // resident pages dropped to make room
+		size_t write_backs = 0; // dirty pages written to the file
+
+		double hit_ratio() const
+		{
+			return hits + misses ? double(hits) / (hits + misses) : 0;
+		}
+	};
+
+	/*
+	 * Blocks kept as fixed-size pages of a file (page id = block id, the page at offset 0 is reserved
+	 * for a file header), cached in a buffer pool of pool_pages frames. A handle pins its page from load
+	 * to store, unpinned pages stay cached until the CLOCK hand evicts them. Only pages stored as dirty
+	 * get written back (on eviction or flush). Freed page ids are reused.
+	 *
+	 * The pool must hold all the pins at once: an isam pins its loaded block, one more page while
+	 * loading the next one and the new half of a split (MIN_POOL_PAGES), every live iterator and every
+	 * concurrent reader pins one more. Too small a pool throws "buffer pool is full of pinned pages".
+	 *
+	 * Blocks are raw bytes in the file => the stored keys and values must be trivially copyable.
+	 */
+	class file_pages
+	{
+	public:
+		static const size_t DEFAULT_POOL_PAGES = 64;
+		static const size_t MIN_POOL_PAGES = 3;
+
+		file_pages(const std::string& path, size_t page_size, size_t pool_pages = DEFAULT_POOL_PAGES)
+			: page_size_(page_size), pool_pages_(pool_pages)
+		{
+			if (page_size_ == 0) throw std::invalid_argument("page size must not be zero");
+			if (pool_pages_ < MIN_POOL_PAGES)
+				throw std::invalid_argument("buffer pool needs at least " + std::to_string(MIN_POOL_PAGES) + " pages");
+
+			fd_ = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+			if (fd_ < 0)
+			{
+				perror("open");
+				throw std::runtime_error("could not open block file");
+			}
+		}
+
+		~file_pages()
+		{
+			for (auto& frame : frames_) std::free(frame.data);
+			close(fd_);
+		}
+
+		file_pages(const file_pages&) = delete;
+		file_pages& operator=(const file_pages&) = delete;
+
+		size_t page_size() const { return page_size_; }
+
+		size_t pool_pages() const { return pool_pages_; }
+
+		const pool_statistics& statistics() const { return statistics_; }
+
+		size_t create(size_t block_size)
+		{
+			if (block_size > page_size_) throw std::length_error("block does not fit into a page");
+
+			size_t page_id;
+			if (!free_pages_.empty())
+			{
+				page_id = free_pages_.back();
+				free_pages_.pop_back();
+			}
+			else
+			{
+				page_id = used_.size();
+				used_.push_back(false);
+			}
+			used_[page_id] = true;
+
+			// New blocks read as zeros, the file gets them on write back
+			auto& frame = frames_[claim_frame(page_id)];
+			std::memset(frame.data, 0, page_size_);
+			frame.dirty = true;
+			return page_id;
+		}
+
+		void* load(size_t page_id)
+		{
+			if (!is_used(page_id)) return nullptr;
+
+			auto resident = page_table_.find(page_id);
+			if (resident != page_table_.end())
+			{
+				++statistics_.hits;
+				auto& frame = frames_[resident->second];
+				frame.referenced = true;
+				++frame.pins;
+				return frame.data;
+			}
+
+			++statistics_.misses;
+			auto& frame = frames_[claim_frame(page_id)];
+			read_page(page_id, frame.data);
+			++frame.pins;
+			return frame.data;
+		}
+
+		void store(size_t page_id, void* block_ptr, bool dirty)
+		{
+			auto resident = page_table_.find(page_id);
+			if (resident == page_table_.end() || frames_[resident->second].data != block_ptr)
+				throw std::logic_error("storing a block which is not loaded");
+
+			auto& frame = frames_[resident->second];
+			if (frame.pins == 0) throw std::logic_error("storing a block which is not pinned");
+			frame.dirty |= dirty;
+			--frame.pins;
+		}
+
+		void free(size_t page_id)
+		{
+			if (!is_used(page_id)) return;
+
+			auto resident = page_table_.find(page_id);
+			if (resident != page_table_.end() && frames_[resident->second].pins > 0)
+				throw std::logic_error("freeing a pinned block");
+
+			used_[page_id] = false;
+			free_pages_.push_back(page_id);
+
+			// The content is garbage now => no write back
+			if (resident != page_table_.end())
+			{
+				auto& frame = frames_[resident->second];
+				frame.page_id = 0;
+				frame.dirty = frame.referenced = false;
+				free_frames_.push_back(resident->second);
+				page_table_.erase(resident);
+			}
+		}
+
+		// Writes all the dirty pages back (they stay cached)
+		void flush()
+		{
+			for (auto& frame : frames_)
+			{
+				if (frame.page_id == 0 || !frame.dirty) continue;
+				write_page(frame.page_id, frame.data);
+				frame.dirty = false;
+				++statistics_.write_backs;
+			}
+		}
+
+	private:
+		struct frame
+		{
+			size_t page_id;  // 0 => empty
+			void* data;
+			size_t pins;
+			bool dirty;
+			bool referenced; // second chance of the CLOCK
+		};
+
+		int fd_ = -1;
+		const size_t page_size_;
+		const size_t pool_pages_;
+
+		// Page 0 is the file header
+		std::vector<bool> used_{ true };
+		std::vector<size_t> free_pages_;
+
+		std::vector<frame> frames_;
+		std::vector<size_t> free_frames_;
+		std::unordered_map<size_t, size_t> page_table_;
+		size_t clock_hand_ = 0;
+
+		pool_statistics statistics_;
+
+		bool is_used(size_t page_id) const
+		{
+			return page_id > 0 && page_id < used_.size() && used_[page_id];
+		}
+
+		// Frame for the page (unpinned, clean) - an empty one while the budget allows, else the CLOCK victim
+		size_t claim_frame(size_t page_id)
+		{
+			size_t index;
+			if (!free_frames_.empty())
+			{
+				index = free_frames_.back();
+				free_frames_.pop_back();
+			}
+			else if (frames_.size() < pool_pages_)
+			{
+				void* data = std::malloc(page_size_);
+				if (!data) throw std::bad_alloc();
+				index = frames_.size();
+				frames_.push_back(frame{ 0, data, 0, false, false });
+			}
+			else index = evict();
+
+			auto& claimed = frames_[index];
+			claimed.page_id = page_id;
+			claimed.pins = 0;
+			claimed.dirty = false;
+			claimed.referenced = true;
+			page_table_[page_id] = index;
+			return index;
+		}
+
+		size_t evict()
+		{
+			// Two rounds: the first one may only clear the reference bits
+			for (size_t step = 0; step < 2 * frames_.size(); ++step)
+			{
+				size_t index = clock_hand_;
+				clock_hand_ = (clock_hand_ + 1) % frames_.size();
+
+				auto& victim = frames_[index];
+				if (victim.pins > 0) continue;
+				if (victim.referenced)
+				{
+					victim.referenced = false;
+					continue;
+				}
+
+				if (victim.dirty)
+				{
+					write_page(victim.page_id, victim.data);
+					++statistics_.write_backs;
+				}
+				++statistics_.evictions;
+				page_table_.erase(victim.page_id);
+				return index;
+			}
+			throw std::runtime_error("buffer pool is full of pinned pages");
+		}
+
+		void read_page(size_t page_id, void* target)
+		{
+			auto* bytes = static_cast<char*>(target);
+			size_t done = 0;
+			while (done < page_size_)
+			{
+				auto count = pread(fd_, bytes + done, page_size_ - done, page_id * page_size_ + done);
+				if (count < 0 && errno == EINTR) continue;
+				if (count < 0) throw std::runtime_error(std::string("pread failed: ") + strerror(errno));
+				if (count == 0) break;
+				done += count;
+			}
+
+			// Behind the end of the file
+			std::memset(bytes + done, 0, page_size_ - done);
+		}
+
+		void write_page(size_t page_id, const void* source)
+		{
+			auto* bytes = static_cast<const char*>(source);
+			size_t done = 0;
+			while (done < page_size_)
+			{
+				auto count = pwrite(fd_, bytes + done, page_size_ - done, page_id * page_size_ + done);
+				if (count < 0 && errno == EINTR) continue;
+				if (count <= 0) throw std::runtime_error(std::string("pwrite failed: ") + strerror(errno));
+				done += count;
+			}
+		}
+	};
+
+	std::unique_ptr<file_pages> file_;
+
+	/*
+	 * Blocks live in the page file until close_file (open it before the first block is created).
+	 * The file is scratch space: truncated on open, its pages can't be reopened. Persistence goes through
+	 * isam::save (works in both modes) and isam::open, which maps the blocks => memory mode only.
+	 */
+	inline void open_file(const std::string& path, size_t page_size,
+		size_t pool_pages = file_pages::DEFAULT_POOL_PAGES)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		file_ = std::make_unique<file_pages>(path, page_size, pool_pages);
+	}
+
+	inline void close_file()
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (file_) file_->flush();
+		file_.reset();
+	}
+
+	// Buffer pool counters of the page file (empty in the memory mode)
+	inline pool_statistics statistics()
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		return file_ ? file_->statistics() : pool_statistics();
+	}
+
 	inline size_t create_block(size_t block_size)
 	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (file_) return file_->create(block_size);
+
 		auto block_id = last_block_id_++;
 		blocks_[block_id] = malloc(block_size);
 		memset(blocks_[block_id], 0, block_size);
 		return block_id;
 	}
 
+	// Adopts memory as a block (memory mode only), the owner keeps it valid while the block is used
+	inline size_t map_block(void* data)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (file_) throw std::logic_error("mapped blocks need the memory mode");
+
+		auto block_id = last_block_id_++;
+		blocks_[block_id] = data;
+		mapped_.insert(block_id);
+		return block_id;
+	}
+
 	inline void* load_block(size_t block_id)
 	{
 		++read_count_;
 		++block_in_memory_;
 
-		//if not exist
-		if (blocks_.find(block_id) == blocks_.end())
 		{
-			return nullptr;
+			std::shared_lock<std::shared_mutex> lock(mutex_);
+			if (!file_)
+			{
+				//if not exist
+				auto found = blocks_.find(block_id);
+				if (found == blocks_.end())
+				{
+					return nullptr;
+				}
+				return found->second;
+			}
 		}
-		return blocks_[block_id];
+
+		// The page file moves pins and the CLOCK => exclusive
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (!file_) throw std::logic_error("block file closed during a load");
+		return file_->load(block_id);
 	}
 
-	inline void store_block(size_t block_id, void* block_ptr)
+	// dirty = the block was modified since the load (clean pages are not written back)
+	inline void store_block(size_t block_id, void* block_ptr, bool dirty = true)
 	{
 		--block_in_memory_;
+
+		// The block stays where it was loaded from => nothing to change (the usual case)
+		bool file_mode;
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex_);
+			file_mode = file_ != nullptr;
+			if (!file_mode)
+			{
+				auto found = blocks_.find(block_id);
+				if (found != blocks_.end() && found->second == block_ptr) return;
+			}
+		}
+
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (file_mode != (file_ != nullptr)) throw std::logic_error("block file opened or closed during a store");
+		if (file_)
+		{
+			file_->store(block_id, block_ptr, dirty);
+			return;
+		}
 		blocks_[block_id] = block_ptr;
 	}
 
 	inline void free_block(size_t block_id)
 	{
-		free(blocks_[block_id]);
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		if (file_)
+		{
+			file_->free(block_id);
+			return;
+		}
+
+		if (!mapped_.erase(block_id)) free(blocks_[block_id]);
 		blocks_.erase(block_id);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,322 @@
+#ifndef ISAM_CONCURRENT_ISAM_HPP
+#define ISAM_CONCURRENT_ISAM_HPP
+
+#include<array>
+#include<atomic>
+#include<thread>
+#include<mutex>
+#include<shared_mutex>
+#include<functional>
+#include<unordered_map>
+#include<cassert>
+#include"isam.hpp"
+
+/*
+ * isam shared by threads. Three kinds of locks:
+ *  - structure: shared by every operation, exclusive just for the overflow flush (splits, appends, fences)
+ *  - block latches (striped by the block): readers of a block share, an in-place value update is exclusive
+ *  - overflow: lookups share, inserts are exclusive
+ * Readers run in parallel with the writers updating blocks or inserting into the overflow, only a flush
+ * stops everything. Values are returned by copy (a reference could be moved by the next flush).
+ * In the file mode of the block provider every block load takes the provider mutex exclusively (pins,
+ * CLOCK) => the readers don't run in parallel there, just the memory mode scales.
+ *
+ * snapshot() gives a read-only view of the current state for long scans: it shares the blocks with the
+ * index, the first write of a block after the snapshot copies its old values aside for the view.
+ */
+namespace {
+    // Reader-writer latch preferring the writers: new readers stay out while a writer waits
+    // (a busy stream of readers would starve it otherwise)
+    class latch {
+    private:
+        std::shared_mutex mutex;
+        std::atomic<size_t> waiting_writers{0};
+
+    public:
+        void lock() {
+            ++waiting_writers;
+            mutex.lock();
+            --waiting_writers;
+        }
+
+        void unlock() { mutex.unlock(); }
+
+        void lock_shared() {
+            while (waiting_writers.load(std::memory_order_acquire)) std::this_thread::yield();
+            mutex.lock_shared();
+        }
+
+        void unlock_shared() { mutex.unlock_shared(); }
+    };
+}
+
+template<typename TKey, typename TValue>
+class concurrent_isam {
+private:
+    typedef isam<TKey, TValue> index_type;
+    typedef typename index_type::key_value_pair key_value_pair;
+    typedef typename index_type::file_block file_block;
+
+    static const size_t LATCH_STRIPES = 64;
+
+    index_type index;
+
+    mutable latch structure;
+    mutable latch overflow_latch;
+    mutable std::array<latch, LATCH_STRIPES> block_latches;
+
+    latch &block_latch(const file_block *block) const {
+        return block_latches[std::hash<const file_block *>()(block) % LATCH_STRIPES];
+    }
+
+    // Values of a block as the snapshots saw them - filled by the first write after the snapshots
+    struct block_version {
+        bool copied = false;
+        std::vector<key_value_pair> values;
+    };
+
+    // The version of every block referenced by a snapshot and not written since
+    std::unordered_map<const file_block *, std::shared_ptr<block_version>> versions;
+    std::mutex versions_mutex;
+
+    // The views read the blocks of the index => none may outlive it
+    mutable std::atomic<size_t> live_snapshots{0};
+
+    // Before a write of the block (its latch or the structure held exclusively)
+    void copy_on_write(file_block *block) {
+        std::shared_ptr<block_version> version;
+        {
+            std::lock_guard<std::mutex> lock(versions_mutex);
+            auto found = versions.find(block);
+            if (found == versions.end()) return;
+
+            version = std::move(found->second);
+            versions.erase(found);
+        }
+
+        // A snapshot still reads this version (the last reference gone => freed with it)
+        if (version.use_count() > 1) {
+            auto handle = block->load();
+            for (size_t index = 0; index < block->get_size(); ++index) version->values.push_back(handle.get(index));
+            version->copied = true;
+        }
+    }
+
+    // Overwrites the value if the key is in a block (structure lock held)
+    bool update_in_block(const TKey &key, const TValue &value) {
+        auto position = index.file_block_index.find(key);
+        if (position == index.file_block_index.size()) return false;
+
+        auto *found = index.file_block_index.block(position);
+        std::unique_lock<latch> block_lock(block_latch(found));
+
+        auto handle = found->load();
+        auto slot = handle.find(key);
+        if (slot < 0) return false;
+
+        copy_on_write(found);
+        handle[slot] = value;
+        return true;
+    }
+
+public:
+    concurrent_isam(size_t block_size, size_t overflow_size) : index(block_size, overflow_size) {
+        index.before_block_write = [this](file_block *block) { copy_on_write(block); };
+    }
+
+    ~concurrent_isam() {
+        assert(live_snapshots == 0 && "a snapshot outlives its concurrent_isam");
+    }
+
+    concurrent_isam(const concurrent_isam &) = delete;
+
+    concurrent_isam &operator=(const concurrent_isam &) = delete;
+
+    /*
+     * Read-only view of the index at the time of concurrent_isam::snapshot(), the writers go on meanwhile.
+     * Must not outlive the index (the index counts its live views, a debug build asserts on it).
+     * The old block versions are released with the last view using them.
+     */
+    class snapshot_view {
+    private:
+        friend class concurrent_isam;
+
+        const concurrent_isam *owner;
+
+        // Blocks in the key order with their fences and versions
+        std::vector<TKey> min_keys;
+        std::vector<TKey> max_keys;
+        std::vector<std::pair<file_block *, std::shared_ptr<block_version>>> blocks;
+
+        std::vector<key_value_pair> overflow;
+
+        explicit snapshot_view(const concurrent_isam *owner) : owner(owner) { ++owner->live_snapshots; }
+
+        void read_block(size_t position, std::vector<key_value_pair> &values) const {
+            std::shared_lock<latch> structure_lock(owner->structure);
+            std::shared_lock<latch> block_lock(owner->block_latch(blocks[position].first));
+
+            auto &version = *blocks[position].second;
+            if (version.copied) {
+                values = version.values;
+                return;
+            }
+
+            // Not written since the snapshot
+            auto *block = blocks[position].first;
+            auto handle = block->load();
+            values.clear();
+            for (size_t index = 0; index < block->get_size(); ++index) values.push_back(handle.get(index));
+        }
+
+    public:
+        snapshot_view(const snapshot_view &other) :
+                owner(other.owner), min_keys(other.min_keys), max_keys(other.max_keys), blocks(other.blocks),
+                overflow(other.overflow) {
+            ++owner->live_snapshots;
+        }
+
+        snapshot_view &operator=(const snapshot_view &other) {
+            if (this == &other) return *this;
+            ++other.owner->live_snapshots;
+            --owner->live_snapshots;
+
+            owner = other.owner;
+            min_keys = other.min_keys;
+            max_keys = other.max_keys;
+            blocks = other.blocks;
+            overflow = other.overflow;
+            return *this;
+        }
+
+        ~snapshot_view() { --owner->live_snapshots; }
+
+        bool find(const TKey &key, TValue &value) const {
+            auto position = std::lower_bound(max_keys.begin(), max_keys.end(), key) - max_keys.begin();
+            if (position < (ptrdiff_t) blocks.size() && !(key < min_keys[position])) {
+                std::vector<key_value_pair> values;
+                read_block(position, values);
+
+                auto found = std::lower_bound(values.begin(), values.end(), key,
+                                              [](const key_value_pair &value, const TKey &key) {
+                                                  return value.first < key;
+                                              });
+                if (found != values.end() && !(key < found->first)) {
+                    value = found->second;
+                    return true;
+                }
+            }
+
+            auto found = std::lower_bound(overflow.begin(), overflow.end(), key,
+                                          [](const key_value_pair &value, const TKey &key) {
+                                              return value.first < key;
+                                          });
+            if (found == overflow.end() || key < found->first) return false;
+
+            value = found->second;
+            return true;
+        }
+
+        TValue get(const TKey &key) const {
+            TValue value = TValue();
+            find(key, value);
+            return value;
+        }
+
+        // Calls f(key, value) in the key order, a block at a time (no lock held during the calls)
+        template<typename F>
+        void for_each(F &&f) const {
+            std::vector<key_value_pair> values;
+            auto pending = overflow.begin();
+
+            for (size_t position = 0; position < blocks.size(); ++position) {
+                read_block(position, values);
+
+                for (auto &value : values) {
+                    for (; pending != overflow.end() && pending->first < value.first; ++pending) {
+                        f(pending->first, pending->second);
+                    }
+                    f(value.first, value.second);
+                }
+            }
+            for (; pending != overflow.end(); ++pending) f(pending->first, pending->second);
+        }
+    };
+
+    // Writers wait just while the block list and the overflow (at most overflow_size pairs) get recorded
+    snapshot_view snapshot() {
+        std::unique_lock<latch> structure_lock(structure);
+        std::lock_guard<std::mutex> lock(versions_mutex);
+
+        snapshot_view view(this);
+        auto &fences = index.file_block_index;
+        for (size_t position = 0; position < fences.size(); ++position) {
+            auto *block = fences.block(position);
+
+            auto &version = versions[block];
+            if (!version) version = std::make_shared<block_version>();
+
+            view.min_keys.push_back(fences.min_key(position));
+            view.max_keys.push_back(fences.max_key(position));
+            view.blocks.emplace_back(block, version);
+        }
+        view.overflow = index.overflow;
+        return view;
+    }
+
+    // Copies the value of the key, false if missing
+    bool find(const TKey &key, TValue &value) const {
+        std::shared_lock<latch> structure_lock(structure);
+
+        auto position = index.file_block_index.find(key);
+        if (position != index.file_block_index.size()) {
+            auto *found = index.file_block_index.block(position);
+            std::shared_lock<latch> block_lock(block_latch(found));
+
+            auto handle = found->load();
+            auto slot = handle.find(key);
+            if (slot >= 0) {
+                value = handle.get(slot).second;
+                return true;
+            }
+        }
+
+        std::shared_lock<latch> overflow_lock(overflow_latch);
+        auto in_overflow = index.overflow_lower_bound(key);
+        if (in_overflow == index.overflow.end() || key < in_overflow->first) return false;
+
+        value = in_overflow->second;
+        return true;
+    }
+
+    // The value of the key, the default value if missing (nothing gets inserted)
+    TValue get(const TKey &key) const {
+        TValue value = TValue();
+        find(key, value);
+        return value;
+    }
+
+    void put(const TKey &key, const TValue &value) {
+        {
+            std::shared_lock<latch> structure_lock(structure);
+            if (update_in_block(key, value)) return;
+
+            std::unique_lock<latch> overflow_lock(overflow_latch);
+            index.overflow_value(key) = value;
+            if (index.overflow.size() < index.max_overflow_size) return;
+        }
+
+        // Full overflow => flush alone (another writer may have done it meanwhile - checked again)
+        std::unique_lock<latch> structure_lock(structure);
+        index.check_flush_overflow();
+    }
+
+    // Calls f(key, value) in the key order, writers wait meanwhile
+    template<typename F>
+    void for_each(F &&f) const {
+        std::unique_lock<latch> structure_lock(structure);
+        for (auto &&it : index) f(it.first, it.second);
+    }
+};
+
+#endif // ISAM_CONCURRENT_ISAM_HPP
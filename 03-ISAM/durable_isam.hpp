@@ -0,0 +1,132 @@
+#ifndef ISAM_DURABLE_ISAM_HPP
+#define ISAM_DURABLE_ISAM_HPP
+
+#include<string>
+#include<vector>
+#include<deque>
+#include<memory>
+#include<mutex>
+#include<unistd.h>
+#include"isam.hpp"
+#include"write_ahead_log.hpp"
+
+/*
+ * isam surviving restarts (trivially copyable keys and values): the state is the last checkpoint
+ * (isam::save) plus the write-ahead log of the inserts since then. A put returns once its log record
+ * is on disk, concurrent puts share the fdatasync (group commit). The index gets the change only once
+ * it is durable (in the log order), a failed log write fails every later put and checkpoint.
+ * A checkpoint saves the isam and truncates the log, automatically once the log reaches checkpoint_bytes.
+ * On startup the checkpoint gets mapped (isam::open) and the log replayed into it.
+ */
+template<typename TKey, typename TValue>
+class durable_isam {
+private:
+    typedef isam<TKey, TValue> index_type;
+    typedef std::pair<TKey, TValue> key_value_pair;
+
+    // Logged change waiting for its sync
+    struct pending_change {
+        uint64_t sequence; // of its last record
+        std::vector<key_value_pair> pairs;
+    };
+
+    const std::string checkpoint_path;
+    const uint64_t checkpoint_bytes;
+
+    std::unique_ptr<index_type> index;
+    write_ahead_log<TKey, TValue> log;
+
+    mutable std::mutex index_mutex; // keeps the log order = the order of the changes
+    std::deque<pending_change> pending;
+
+    // Applies the logged changes up to the sequence number in the log order (index_mutex held)
+    void apply_pending(uint64_t sequence) {
+        while (!pending.empty() && pending.front().sequence <= sequence) {
+            auto &change = pending.front();
+            if (change.pairs.size() == 1) (*index)[change.pairs.front().first] = change.pairs.front().second;
+            else index->put_many(change.pairs);
+            pending.pop_front();
+        }
+    }
+
+    void commit(std::vector<key_value_pair> &&pairs) {
+        uint64_t sequence = 0;
+        {
+            std::lock_guard<std::mutex> lock(index_mutex);
+            for (auto &pair : pairs) sequence = log.append(pair.first, pair.second);
+            pending.push_back(pending_change{sequence, std::move(pairs)});
+        }
+
+        log.sync(sequence);
+        {
+            std::lock_guard<std::mutex> lock(index_mutex);
+            apply_pending(sequence);
+        }
+        check_checkpoint();
+    }
+
+    void checkpoint_locked() {
+        // Everything logged becomes durable and applied - the truncated log must not miss a record
+        const uint64_t last = log.last_sequence();
+        log.sync(last);
+        apply_pending(last);
+
+        index->save(checkpoint_path);
+        log.truncate();
+    }
+
+    void check_checkpoint() {
+        if (log.bytes() < checkpoint_bytes) return;
+
+        std::lock_guard<std::mutex> lock(index_mutex);
+        if (log.bytes() >= checkpoint_bytes) checkpoint_locked();
+    }
+
+public:
+    /*
+     * block_size and overflow_size shape a new index only: an existing checkpoint keeps the sizes it was
+     * saved with, the arguments are ignored then.
+     */
+    durable_isam(const std::string &checkpoint_path, const std::string &log_path,
+                 size_t block_size, size_t overflow_size,
+                 const group_commit_options &options = group_commit_options(),
+                 uint64_t checkpoint_bytes = 64 << 20) :
+            checkpoint_path(checkpoint_path),
+            checkpoint_bytes(checkpoint_bytes),
+            log(log_path, options) {
+
+        if (access(checkpoint_path.c_str(), F_OK) == 0) index.reset(new index_type(index_type::open(checkpoint_path)));
+        else index = std::make_unique<index_type>(block_size, overflow_size);
+
+        // The inserts since the checkpoint (they land in the overflow / blocks as usual)
+        log.replay([this](const TKey &key, const TValue &value) { (*index)[key] = value; });
+    }
+
+    // Returns once the value is durable
+    void put(const TKey &key, const TValue &value) {
+        commit(std::vector<key_value_pair>{key_value_pair(key, value)});
+    }
+
+    // The whole batch shares a single sync
+    void put_many(const std::vector<key_value_pair> &pairs) {
+        if (!pairs.empty()) commit(std::vector<key_value_pair>(pairs));
+    }
+
+    // The value of the key, the default value if missing
+    TValue get(const TKey &key) const {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        const index_type &lookup = *index;
+        return lookup[key];
+    }
+
+    void checkpoint() {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        checkpoint_locked();
+    }
+
+    uint64_t log_bytes() { return log.bytes(); }
+
+    size_t log_syncs() { return log.syncs(); }
+};
+
+#endif // ISAM_DURABLE_ISAM_HPP
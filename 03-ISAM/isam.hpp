@@ -3,25 +3,217 @@
 
 // Vladislav Vancak
 
-#include<map>
+#include<vector>
+#include<iterator>
 #include<memory>
+#include<algorithm>
+#include<stdexcept>
+#include<type_traits>
+#include<functional>
+#include<fstream>
+#include<string>
+#include<cstdint>
+#include<cstring>
+#include<cstdio>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #include"block_provider.hpp"
 
+#if defined(__GNUC__)
+#define ISAM_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define ISAM_PREFETCH(address)
+#endif
+
 namespace {
     const double FILL_FACTOR_SPLIT = 0.75;
     const double FILL_FACTOR_DELIMITER = 2;
+    const double FILL_FACTOR_BULK_LOAD = 0.75;
+
+    // Keys left for the compare-all step of the key column search (one cache line of 32-bit keys)
+    const size_t KEY_SCAN_SIZE = 16;
+
+    /*
+     * Values waiting for a flush, smallest first: the rest of the (sorted) overflow run and the run
+     * of values carried out of the full blocks. Both are flat => merging is linear, no node per value.
+     */
+    template<typename TKey, typename TValue>
+    class pending_runs {
+    private:
+        typedef std::pair<TKey, TValue> key_value_pair;
+
+        const std::vector<key_value_pair> &run;
+        size_t run_position = 0;
+
+        std::vector<key_value_pair> carried;
+        size_t carried_position = 0;
+
+        std::vector<key_value_pair> merged;
+
+        bool front_carried() const {
+            if (carried_position == carried.size()) return false;
+            if (run_position == run.size()) return true;
+            return carried[carried_position].first < run[run_position].first;
+        }
+
+    public:
+        // Block values during a merge (reused buffer)
+        std::vector<key_value_pair> aside;
+
+        explicit pending_runs(const std::vector<key_value_pair> &run) : run(run) {}
+
+        bool empty() const { return run_position == run.size() && carried_position == carried.size(); }
+
+        const key_value_pair &front() const {
+            return front_carried() ? carried[carried_position] : run[run_position];
+        }
+
+        void pop() {
+            if (front_carried()) ++carried_position;
+            else ++run_position;
+        }
+
+        // Sorted values pushed out of a block
+        template<typename Iterator>
+        void carry(Iterator first, Iterator last) {
+            if (first == last) return;
+
+            auto by_key = [](const key_value_pair &a, const key_value_pair &b) { return a.first < b.first; };
+            merged.clear();
+            std::merge(carried.begin() + carried_position, carried.end(), first, last,
+                       std::back_inserter(merged), by_key);
+            carried.swap(merged);
+            carried_position = 0;
+        }
+    };
+
+    /*
+     * Saved isam (trivially copyable keys and values), all the sections in the order of the offsets:
+     * header | min keys | max keys | block sizes (uint64_t) | overflow (key | value each) | blocks (block_stride
+     * each, aligned to FILE_BLOCKS_ALIGNMENT). The blocks are the raw block memory => usable in place when mapped.
+     */
+    const uint64_t FILE_MAGIC = 0x324d415349ULL; // "ISAM2"
+    const uint64_t FILE_BLOCKS_ALIGNMENT = 4096;
+
+    struct file_header {
+        uint64_t magic;
+        uint64_t key_size;
+        uint64_t value_size;
+        uint64_t pair_size;
+        uint64_t block_size;
+        uint64_t block_stride;
+        uint64_t max_overflow_size;
+        uint64_t block_count;
+        uint64_t overflow_count;
+        uint64_t blocks_offset;
+    };
+
+    /*
+     * The index level: fence keys of the blocks in the key order, block i covers [min_key(i), max_key(i)].
+     * The keys are kept in flat arrays (structure of arrays) with a summary of every NODE_SIZE-th max key
+     * on top => a lookup is a branch-free binary search in the summary and in a single node.
+     * Lookups don't modify anything (concurrent readers are fine).
+     */
+    template<typename TKey, typename TBlock>
+    class fence_index {
+    private:
+        static constexpr size_t NODE_SIZE = 16;
+
+        std::vector<TKey> min_keys;
+        std::vector<TKey> max_keys;
+        std::vector<TBlock *> blocks;
+
+        // Max key of every node
+        std::vector<TKey> summary;
+
+        // First index in [0, count) with !(keys[index] < key), count if none
+        static size_t search(const TKey *keys, size_t count, const TKey &key) {
+            if (count == 0) return 0;
+
+            const TKey *base = keys;
+            while (count > 1) {
+                size_t half = count / 2;
+                base = (base[half] < key) ? base + half : base;
+                count -= half;
+            }
+            return (base - keys) + (*base < key);
+        }
+
+        // Nodes from the one of the position on (an append touches the last node only)
+        void rebuild_summary(size_t position) {
+            summary.resize((size() + NODE_SIZE - 1) / NODE_SIZE);
+            for (size_t node = position / NODE_SIZE; node < summary.size(); ++node) {
+                summary[node] = max_keys[std::min(node * NODE_SIZE + NODE_SIZE - 1, size() - 1)];
+            }
+        }
+
+    public:
+        size_t size() const { return blocks.size(); }
+
+        const TKey &min_key(size_t position) const { return min_keys[position]; }
+
+        const TKey &max_key(size_t position) const { return max_keys[position]; }
+
+        TBlock *block(size_t position) const { return blocks[position]; }
+
+        // First block whose max key is not smaller than the key, size() if none
+        size_t lower_bound(const TKey &key) const {
+            size_t node = search(summary.data(), summary.size(), key);
+            if (node == summary.size()) return size();
+
+            size_t first = node * NODE_SIZE;
+            return first + search(max_keys.data() + first, std::min(NODE_SIZE, size() - first), key);
+        }
+
+        // Block covering the key, size() if none
+        size_t find(const TKey &key) const {
+            size_t position = lower_bound(key);
+            if (position < size() && key < min_keys[position]) return size();
+            return position;
+        }
+
+        // The block keeps its place, just the keys change
+        void update(size_t position, const TKey &min, const TKey &max) {
+            min_keys[position] = min;
+            max_keys[position] = max;
+
+            // Last key of a node
+            if (position % NODE_SIZE == NODE_SIZE - 1 || position == size() - 1) {
+                summary[position / NODE_SIZE] = max;
+            }
+        }
+
+        void insert(size_t position, const TKey &min, const TKey &max, TBlock *block) {
+            min_keys.insert(min_keys.begin() + position, min);
+            max_keys.insert(max_keys.begin() + position, max);
+            blocks.insert(blocks.begin() + position, block);
+            rebuild_summary(position);
+        }
+
+        void push_back(const TKey &min, const TKey &max, TBlock *block) {
+            insert(size(), min, max, block);
+        }
+    };
 
     template<typename TKey, typename TValue>
     class block {
     private:
         typedef std::pair<TKey, TValue> key_value_pair;
 
+        /*
+         * Arithmetic keys get a copy in a key column behind the pairs => the search touches the keys only.
+         * The pairs stay (the iterators hand out references to them, with a read-only key).
+         */
+        static constexpr bool KEY_COLUMN = std::is_arithmetic<TKey>::value;
+
         size_t block_id = 0;
         size_t current_size = 0;
         size_t max_size = 0;
 
         void create() {
-            block_id = block_provider::create_block(max_size * sizeof(key_value_pair));
+            block_id = block_provider::create_block(bytes(max_size));
         }
 
         void free() {
@@ -29,18 +221,60 @@ namespace {
         }
 
     public:
+        // Memory of a block holding max_size values
+        static size_t bytes(size_t max_size) {
+            return max_size * (sizeof(key_value_pair) + (KEY_COLUMN ? sizeof(TKey) : 0));
+        }
+
         class handle {
         private:
             block *block_ptr = nullptr;
             key_value_pair *values = nullptr;
 
+            // Written through => the page has to be written back
+            mutable bool modified = false;
+
             void load() {
                 this->values = static_cast<key_value_pair *>(block_provider::load_block(block_ptr->block_id));
             }
 
             void store() {
                 auto *values_void_ptr = static_cast<void *>(values);
-                block_provider::store_block(block_ptr->block_id, values_void_ptr);
+                block_provider::store_block(block_ptr->block_id, values_void_ptr, modified);
+            }
+
+            TKey *keys() const {
+                return reinterpret_cast<TKey *>(values + block_ptr->max_size);
+            }
+
+            // Key writes go through here (keeps the key column in sync)
+            void set(size_t index, const key_value_pair &value) {
+                values[index] = value;
+                if (KEY_COLUMN) keys()[index] = value.first;
+            }
+
+            // Branch-free halving of the key column, the last candidates are compared all at once (vectorizes)
+            int32_t find_in_key_column(const TKey &key) const {
+                const TKey *first = keys();
+                const TKey *base = first;
+                size_t count = block_ptr->current_size;
+
+                while (count > KEY_SCAN_SIZE) {
+                    size_t half = count / 2;
+
+                    // Both possible next probes (the compare result is not speculated)
+                    ISAM_PREFETCH(base + half / 2);
+                    ISAM_PREFETCH(base + half + half / 2);
+                    base = (base[half] < key) ? base + half : base;
+                    count -= half;
+                }
+
+                size_t smaller = 0;
+                for (size_t index = 0; index < count; ++index) smaller += (base[index] < key);
+
+                size_t lower = (base - first) + smaller;
+                if (lower < block_ptr->current_size && !(key < first[lower])) return lower;
+                else return -1;
             }
 
             bool consider_upperbound(const TKey *upper_bound) {
@@ -52,7 +286,8 @@ namespace {
             handle() = default;
 
             handle(handle &&other) noexcept : block_ptr(other.block_ptr),
-                                              values(other.values) {
+                                              values(other.values),
+                                              modified(other.modified) {
                 // prevent other from saving values
                 other.values = nullptr;
             }
@@ -62,6 +297,7 @@ namespace {
 
                 this->block_ptr = other.block_ptr;
                 this->values = other.values;
+                this->modified = other.modified;
 
                 // prevent other from saving values
                 other.values = nullptr;
@@ -69,7 +305,7 @@ namespace {
                 return *this;
             }
 
-            explicit handle(block *block_ptr) : block_ptr(block_ptr) {
+            explicit handle(block *block_ptr) : block_ptr(block_ptr), modified(false) {
                 load();
             }
 
@@ -86,6 +322,8 @@ namespace {
             }
 
             int32_t find(const TKey &key) const {
+                if (KEY_COLUMN) return find_in_key_column(key);
+
                 int32_t upper = block_ptr->current_size - 1;
                 int32_t lower = 0;
 
@@ -98,16 +336,69 @@ namespace {
                     else return index;
                 }
 
+                // The search may end behind the values (stale slots there must not match)
+                if (lower < 0 || lower >= (int32_t) block_ptr->current_size) return -1;
                 if (!(values[lower].first < key) && !(key < values[lower].first)) return lower;
                 else return -1;
             }
 
-            key_value_pair &operator[](size_t index) const {
+            // Writable access to the value marks the block modified, use get for reading
+            TValue &operator[](size_t index) const {
+                modified = true;
+                return values[index].second;
+            }
+
+            // The pair for the iterators - the key can't be written (the key column would get out of sync)
+            std::pair<const TKey, TValue> &entry(size_t index) const {
+                modified = true;
+                return reinterpret_cast<std::pair<const TKey, TValue> &>(values[index]);
+            }
+
+            const key_value_pair &get(size_t index) const {
                 return values[index];
             }
 
+            // The raw block memory (block::bytes long)
+            const char *data() const {
+                return reinterpret_cast<const char *>(values);
+            }
+
+            // Index of the first key not smaller than the key (current size if none)
+            size_t lower_bound(const TKey &key) const {
+                if (KEY_COLUMN) return std::lower_bound(keys(), keys() + block_ptr->current_size, key) - keys();
+
+                return std::lower_bound(values, values + block_ptr->current_size, key,
+                                        [](const key_value_pair &value, const TKey &key) {
+                                            return value.first < key;
+                                        }) - values;
+            }
+
+            // Index of the first key greater than the key (current size if none)
+            size_t upper_bound(const TKey &key) const {
+                if (KEY_COLUMN) return std::upper_bound(keys(), keys() + block_ptr->current_size, key) - keys();
+
+                return std::upper_bound(values, values + block_ptr->current_size, key,
+                                        [](const TKey &key, const key_value_pair &value) {
+                                            return key < value.first;
+                                        }) - values;
+            }
+
             block *get_block_ptr() const { return block_ptr; }
 
+            // Inserts in front of the index (the caller keeps the keys ascending and the block within max_size)
+            void insert(size_t index, const key_value_pair &value) {
+                modified = true;
+                for (size_t moved = block_ptr->current_size; moved > index; --moved) set(moved, values[moved - 1]);
+                set(index, value);
+                ++block_ptr->current_size;
+            }
+
+            // Bulk load: the caller keeps the keys ascending and the block within max_size
+            void push_back(const key_value_pair &value) {
+                modified = true;
+                set(block_ptr->current_size++, value);
+            }
+
             handle split_block() {
 
                 // Create new block
@@ -123,61 +414,56 @@ namespace {
                 size_t count = block_ptr->current_size / 2;
                 size_t init_index = (block_ptr->current_size) - count;
                 for (size_t idx = 0; idx < count; ++idx) {
-                    new_block_handle.values[idx] = values[init_index + idx];
+                    new_block_handle.set(idx, values[init_index + idx]);
                 }
 
                 // Modify sizes
+                modified = new_block_handle.modified = true;
                 block_ptr->current_size -= count;
                 new_block_ptr->current_size = count;
 
                 return std::move(new_block_handle);
             }
 
-            void merge_overflow(std::map<TKey, TValue> &overflow, const TKey *upper_bound) {
+            // Linear merge of the block values and the pending values, the largest block values may get carried out
+            void merge_overflow(pending_runs<TKey, TValue> &pending, const TKey *upper_bound) {
 
                 // Block full and values in overflow too large
-                if (block_ptr->get_size() == block_ptr->max_size && max_key() < overflow.begin()->first) {
+                if (block_ptr->get_size() == block_ptr->max_size && max_key() < pending.front().first) {
                     return;
                 }
 
+                modified = true;
+                const size_t size = block_ptr->current_size;
+                auto &aside = pending.aside;
+                aside.assign(values, values + size);
+
                 // Merge
-                size_t index = 0;
-                while (true) {
-                    // block is full
-                    if (index == block_ptr->max_size) break;
-
-                        // overflow empty
-                    else if (overflow.size() == 0) break;
-
-                        // overflow and values - fill by smaller ones
-                    else if (index < block_ptr->current_size) {
-                        if (values[index].first < overflow.begin()->first) {
-                            ++index;
-                            continue;
-                        }
-
-                        overflow.emplace(values[index]);
-                        auto it = overflow.begin();
-
-                        values[index] = *it;
-                        overflow.erase(it);
+                size_t index = 0, taken = 0;
+                while (index < block_ptr->max_size) {
+                    const bool block_left = taken < size;
+
+                    // both empty
+                    if (!block_left && pending.empty()) break;
+
+                        // values and overflow - fill by smaller ones
+                    else if (block_left && (pending.empty() || aside[taken].first < pending.front().first)) {
+                        set(index, aside[taken++]);
                     }
 
                         // just overflow; but beyond upper bound
-                    else if (consider_upperbound(upper_bound) && *upper_bound < overflow.begin()->first) break;
+                    else if (index >= size && consider_upperbound(upper_bound) && *upper_bound < pending.front().first) break;
 
-                        // just overflow => pure insert
-                    else if (index == block_ptr->current_size) {
-                        block_ptr->current_size += 1;
-                        auto it = overflow.begin();
-
-                        values[index] = *it;
-                        overflow.erase(it);
+                    else {
+                        set(index, pending.front());
+                        pending.pop();
                     }
-                    else throw std::logic_error("should not get here");
 
                     ++index;
                 }
+
+                block_ptr->current_size = index;
+                pending.carry(aside.begin() + taken, aside.end());
             }
         };
 
@@ -185,6 +471,11 @@ namespace {
 
         explicit block(size_t max_size) : current_size(0), max_size(max_size) { create(); }
 
+        // Adopts a block already known to the block provider (e.g. a mapped one)
+        block(size_t max_size, size_t block_id, size_t current_size) : block_id(block_id),
+                                                                        current_size(current_size),
+                                                                        max_size(max_size) {}
+
         ~block() { free(); }
 
         const size_t get_size() const { return current_size; }
@@ -193,9 +484,14 @@ namespace {
     };
 }
 
+template<typename TKey, typename TValue>
+class concurrent_isam;
+
 template<typename TKey, typename TValue>
 class isam {
 private:
+    friend class concurrent_isam<TKey, TValue>;
+
     typedef std::pair<TKey, TValue> key_value_pair;
     typedef block<TKey, TValue> file_block;
     typedef typename file_block::handle file_block_handle;
@@ -213,12 +509,6 @@ private:
         TKey max_key;
     };
 
-    struct key_interval_comparator {
-        bool operator()(const key_interval &first, const key_interval &second) const {
-            return first.max_key < second.min_key;
-        }
-    };
-
     const TValue default_tvalue;
 
     const size_t block_size;
@@ -231,54 +521,165 @@ private:
 
     mutable file_block_handle loaded_block_handle;
 
-    std::map<key_interval, file_block *, key_interval_comparator> file_block_map;
+    // Called before the flush changes the values of a block (copy-on-write of the snapshots)
+    std::function<void(file_block *)> before_block_write;
+
+    // The file mapping of an opened isam (the initial blocks live in it)
+    std::shared_ptr<void> mapping;
+
+    static void check_persistable() {
+        static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                      "persistence needs trivially copyable keys and values");
+    }
+
+    // Overflow record in the file (std::pair itself isn't trivially copyable)
+    static constexpr uint64_t FILE_OVERFLOW_RECORD = sizeof(TKey) + sizeof(TValue);
+
+    static uint64_t block_stride(size_t block_size) {
+        return (file_block::bytes(block_size) + 15) / 16 * 16;
+    }
+
+    struct open_tag {};
+
+    // Maps the saved file, the blocks stay in the (private) mapping => nothing to rebuild but the fences
+    isam(open_tag, const file_header &header, std::shared_ptr<void> &&file_mapping) :
+            default_tvalue(),
+
+            block_size(header.block_size),
+            max_overflow_size(header.max_overflow_size),
+
+            loaded_block(),
+            loaded_block_handle(),
+
+            mapping(std::move(file_mapping)),
+
+            file_block_index{},
+            overflow{} {
+
+        char *file = static_cast<char *>(mapping.get());
+        const size_t count = header.block_count;
+        const char *section = file + sizeof(file_header);
+        const char *min_keys = section;
+        const char *max_keys = min_keys + count * sizeof(TKey);
+        const char *sizes = max_keys + count * sizeof(TKey);
+        const char *records = sizes + count * sizeof(uint64_t);
+
+        file_block *last_block = nullptr;
+        for (size_t position = 0; position < count; ++position) {
+            TKey min, max;
+            uint64_t size;
+            std::memcpy(&min, min_keys + position * sizeof(TKey), sizeof(TKey));
+            std::memcpy(&max, max_keys + position * sizeof(TKey), sizeof(TKey));
+            std::memcpy(&size, sizes + position * sizeof(uint64_t), sizeof(uint64_t));
+
+            auto block_id = block_provider::map_block(file + header.blocks_offset + position * header.block_stride);
+            auto opened = std::make_unique<file_block>(block_size, block_id, size);
+            auto *opened_ptr = opened.get();
+
+            if (last_block) last_block->next = std::move(opened);
+            else first_file_block = std::move(opened);
+            last_block = opened_ptr;
+
+            file_block_index.push_back(min, max, opened_ptr);
+        }
+
+        overflow.resize(header.overflow_count);
+        for (size_t position = 0; position < overflow.size(); ++position) {
+            const char *record = records + position * FILE_OVERFLOW_RECORD;
+            std::memcpy(&overflow[position].first, record, sizeof(TKey));
+            std::memcpy(&overflow[position].second, record + sizeof(TKey), sizeof(TValue));
+        }
+    }
+
+    fence_index<TKey, file_block> file_block_index;
+
+    // Sorted by the key
+    std::vector<key_value_pair> overflow;
+
+    typename std::vector<key_value_pair>::iterator overflow_lower_bound(const TKey &key) {
+        return std::lower_bound(overflow.begin(), overflow.end(), key,
+                                [](const key_value_pair &value, const TKey &key) { return value.first < key; });
+    }
+
+    typename std::vector<key_value_pair>::const_iterator overflow_lower_bound(const TKey &key) const {
+        return std::lower_bound(overflow.begin(), overflow.end(), key,
+                                [](const key_value_pair &value, const TKey &key) { return value.first < key; });
+    }
+
+    // The overflow value of the key (default-inserted if missing)
+    TValue &overflow_value(const TKey &key) {
+        auto position = overflow_lower_bound(key);
+        if (position == overflow.end() || key < position->first) {
+            position = overflow.insert(position, key_value_pair(key, TValue()));
+        }
+        return position->second;
+    }
+
+    typename std::vector<key_value_pair>::iterator overflow_upper_bound(const TKey &key) {
+        return std::upper_bound(overflow.begin(), overflow.end(), key,
+                                [](const TKey &key, const key_value_pair &value) { return key < value.first; });
+    }
+
+    typename std::vector<key_value_pair>::const_iterator overflow_upper_bound(const TKey &key) const {
+        return std::upper_bound(overflow.begin(), overflow.end(), key,
+                                [](const TKey &key, const key_value_pair &value) { return key < value.first; });
+    }
 
-    std::map<TKey, TValue> overflow;
+    // Block and index of the first key not smaller (upper: greater) than the key, null block if none
+    std::pair<file_block *, size_t> block_bound(const TKey &key, bool upper) const {
+        auto position = file_block_index.lower_bound(key);
+        if (position == file_block_index.size()) return std::make_pair(nullptr, 0);
 
-    void check_split_block() {
-        if (!loaded_block) return;
-        if (!loaded_block->next) return;
-        if (block_size < FILL_FACTOR_DELIMITER) return;
-        if (loaded_block->get_size() < FILL_FACTOR_SPLIT * block_size) return;
+        auto *found = file_block_index.block(position);
+        auto found_handle = found->load();
+        size_t index = upper ? found_handle.upper_bound(key) : found_handle.lower_bound(key);
+
+        // Behind the block's last key => the beginning of the next one
+        if (index == found->get_size()) return std::make_pair(found->next.get(), 0);
+        return std::make_pair(found, index);
+    }
+
+    const TValue &overflow_value(const TKey &key) const {
+        auto position = overflow_lower_bound(key);
+        if (position != overflow.end() && !(key < position->first)) return position->second;
+        else return default_tvalue;
+    }
+
+    bool check_split_block(size_t position, const TKey &overflow_smallest_key) {
+        if (!loaded_block) return false;
+        if (!loaded_block->next) return false;
+        if (block_size < FILL_FACTOR_DELIMITER) return false;
+        if (loaded_block->get_size() < FILL_FACTOR_SPLIT * block_size) return false;
 
-        auto &overflow_smallest_key = overflow.begin()->first;
         auto loaded_block_handle = loaded_block->load();
-        if (loaded_block_handle.max_key() < overflow_smallest_key) return;
+        if (loaded_block_handle.max_key() < overflow_smallest_key) return false;
 
         // Split the block
+        if (before_block_write) before_block_write(loaded_block);
         auto new_block_handle = loaded_block_handle.split_block();
 
-        // Insert block into the file map
-        auto entry = std::make_pair(
-                key_interval(new_block_handle.min_key(), new_block_handle.max_key()),
-                new_block_handle.get_block_ptr()
-        );
-        file_block_map.insert(entry);
-        // loaded_block stays where it was
+        // Fences of both halves, loaded_block stays where it was
+        file_block_index.update(position, loaded_block_handle.min_key(), loaded_block_handle.max_key());
+        file_block_index.insert(position + 1, new_block_handle.min_key(), new_block_handle.max_key(),
+                                new_block_handle.get_block_ptr());
+        return true;
     }
 
-    void check_append_next() {
-        if (!loaded_block) return;
-        if (loaded_block->get_size() < block_size) return;
-        if (loaded_block->next) return;
+    bool check_append_next(size_t position, const TKey &overflow_smallest_key) {
+        if (!loaded_block) return false;
+        if (loaded_block->get_size() < block_size) return false;
+        if (loaded_block->next) return false;
 
-        auto &overflow_smallest_key = overflow.begin()->first;
         loaded_block_handle = loaded_block->load();
-        if (overflow_smallest_key < loaded_block_handle.max_key()) return;
+        if (overflow_smallest_key < loaded_block_handle.max_key()) return false;
 
-        // Append next
+        // Append next (its fences get set by the merge)
         loaded_block->next = std::make_unique<file_block>(block_size);
-
-        // Insert block back into the file map
-        loaded_block_handle = loaded_block->load();
-        auto entry = std::make_pair(
-                key_interval(loaded_block_handle.min_key(), loaded_block_handle.max_key()),
-                loaded_block
-        );
-        file_block_map.insert(entry);
+        file_block_index.insert(position + 1, overflow_smallest_key, overflow_smallest_key, loaded_block->next.get());
 
         // Set next loaded block
         loaded_block = loaded_block->next.get();
+        return true;
     }
 
     void check_flush_overflow() {
@@ -287,111 +688,148 @@ private:
         // Make sure first file block exists
         if (!first_file_block) {
             first_file_block = std::make_unique<file_block>(block_size);
-            auto entry = std::make_pair(key_interval(), first_file_block.get());
-            file_block_map.insert(entry);
+            file_block_index.push_back(TKey(), TKey(), first_file_block.get());
         }
 
         loaded_block = first_file_block.get();
 
         // Merging
-        while (overflow.size() > 0) {
-            // Find file block in the map
-            auto &overflow_smallest_key = overflow.begin()->first;
-            auto ki = key_interval(overflow_smallest_key, overflow_smallest_key);
-
-            auto block_map_iterator = file_block_map.lower_bound(ki);
+        pending_runs<TKey, TValue> pending(overflow);
+        while (!pending.empty()) {
+            // Find file block in the index
+            const TKey overflow_smallest_key = pending.front().first;
+            size_t position = file_block_index.lower_bound(overflow_smallest_key);
 
             // No lower bound => last block
-            if (block_map_iterator == file_block_map.end()) --block_map_iterator;
+            if (position == file_block_index.size()) --position;
 
-                // Check previous block (even though smaller, still does not have to be full)
-            else if (block_map_iterator != file_block_map.begin()) {
-                auto previous = block_map_iterator;
-                if ((--previous)->second->get_size() < block_size) --block_map_iterator;
+                // Key in front of the block => the previous block (even though smaller, still does not have to be full)
+            else if (position > 0 && overflow_smallest_key < file_block_index.min_key(position)) {
+                if (file_block_index.block(position - 1)->get_size() < block_size) --position;
             }
 
+            loaded_block = file_block_index.block(position);
+
+            // The key may belong to the new upper half => look the block up again
+            if (check_split_block(position, overflow_smallest_key)) continue;
+            if (check_append_next(position, overflow_smallest_key)) ++position;
+
             // Find the next block min key
-            auto copy = block_map_iterator;
             const TKey *next_block_min_key = nullptr;
-            if (++copy != file_block_map.end()) next_block_min_key = &(copy->first.min_key);
+            if (position + 1 < file_block_index.size()) next_block_min_key = &file_block_index.min_key(position + 1);
 
-            // Erase from map (if was in map)
-            if (block_map_iterator != file_block_map.end()) file_block_map.erase(block_map_iterator);
+            // Load & merge values into the block
+            loaded_block_handle = loaded_block->load();
+            if (before_block_write) before_block_write(loaded_block);
+            loaded_block_handle.merge_overflow(pending, next_block_min_key);
 
-            loaded_block = block_map_iterator->second;
+            file_block_index.update(position, loaded_block_handle.min_key(), loaded_block_handle.max_key());
+        }
+        overflow.clear();
+    }
 
-            check_split_block();
-            check_append_next();
+    // Batch positions ordered by the key (stable => the later of equal keys comes later)
+    template<typename Key>
+    static std::vector<size_t> key_order(size_t count, Key &&key) {
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return key(a) < key(b); });
+        return order;
+    }
 
-            // Load & merge values into the block
-            loaded_block_handle = loaded_block->load();
-            loaded_block_handle.merge_overflow(overflow, next_block_min_key);
+    // Appends blocks filled to fill_factor in the key order, every block gets loaded and stored once
+    template<typename InputIterator>
+    void bulk_load(InputIterator first, InputIterator last, double fill_factor) {
+        if (!(fill_factor > 0 && fill_factor <= 1)) throw std::invalid_argument("fill factor must be in (0, 1]");
+        const size_t block_fill = std::max<size_t>(1, size_t(block_size * fill_factor));
 
-            // Insert into the map
-            auto entry = std::make_pair(
-                    key_interval(loaded_block_handle.min_key(), loaded_block_handle.max_key()),
-                    loaded_block
-            );
-            file_block_map.insert(entry);
+        file_block *last_block = nullptr;
+        file_block_handle handle;
+
+        auto insert_block = [&]() {
+            file_block_index.push_back(handle.min_key(), handle.max_key(), last_block);
+        };
+
+        for (; first != last; ++first) {
+            key_value_pair value = *first;
+
+            if (last_block) {
+                // Repeated key => the last value wins (as with operator[])
+                if (!(handle.max_key() < value.first)) {
+                    if (value.first < handle.max_key()) throw std::invalid_argument("bulk load input is not sorted");
+                    handle[last_block->get_size() - 1] = value.second;
+                    continue;
+                }
+                if (last_block->get_size() < block_fill) {
+                    handle.push_back(value);
+                    continue;
+                }
+
+                // Block filled => next one
+                insert_block();
+                last_block->next = std::make_unique<file_block>(block_size);
+                last_block = last_block->next.get();
+            }
+            else {
+                first_file_block = std::make_unique<file_block>(block_size);
+                last_block = first_file_block.get();
+            }
+
+            handle = last_block->load();
+            handle.push_back(value);
         }
+
+        if (last_block) insert_block();
     }
 
     TValue &get_interval_value(const key_interval &ki) {
         check_flush_overflow();
 
         // File Block lookup
-        auto file_block_it = file_block_map.find(ki);
+        auto position = file_block_index.find(ki.min_key);
 
         // No entry => Overflow
-        if (file_block_it == file_block_map.end()) return overflow[ki.min_key];
+        if (position == file_block_index.size()) return overflow_value(ki.min_key);
 
         // Load file block
-        if (loaded_block != file_block_it->second) {
-            loaded_block = file_block_it->second;
+        if (loaded_block != file_block_index.block(position)) {
+            loaded_block = file_block_index.block(position);
             loaded_block_handle = loaded_block->load();
         }
 
         // Try get value from the file block (else overflow)
         auto index = loaded_block_handle.find(ki.min_key);
 
-        if (index < 0) return overflow[ki.min_key];
-        else return loaded_block_handle[index].second;
+        if (index < 0) return overflow_value(ki.min_key);
+        else return loaded_block_handle[index];
     }
 
     const TValue &get_interval_value(const key_interval &ki) const {
 
         // File Block lookup
-        auto file_block_it = file_block_map.find(ki);
+        auto position = file_block_index.find(ki.min_key);
 
         // No entry => Overflow
-        if (file_block_it == file_block_map.end()) {
-            auto pos = overflow.find(ki.min_key);
-            if (pos != overflow.end()) return pos->second;
-            else return default_tvalue;
-        }
+        if (position == file_block_index.size()) return overflow_value(ki.min_key);
 
         // Load file block
-        if (loaded_block != file_block_it->second) {
-            loaded_block = file_block_it->second;
+        if (loaded_block != file_block_index.block(position)) {
+            loaded_block = file_block_index.block(position);
             loaded_block_handle = loaded_block->load();
         }
 
         // Try get value from the file block (else overflow)
         auto index = loaded_block_handle.find(ki.min_key);
 
-        if (index < 0) {
-            auto pos = overflow.find(ki.min_key);
-            if (pos != overflow.end()) return pos->second;
-            else return default_tvalue;
-        }
-        else return loaded_block_handle[index].second;
+        if (index < 0) return overflow_value(ki.min_key);
+        else return loaded_block_handle.get(index).second;
     }
 
 public:
 
     class iterator {
     private:
-        typedef typename std::map<TKey, TValue>::iterator overflow_iterator;
+        typedef typename std::vector<key_value_pair>::iterator overflow_iterator;
 
         // overflow
         overflow_iterator overflow_it;
@@ -409,7 +847,7 @@ public:
             if (overflow_it == overflow_end) return false;
 
             // both have values => check if overflow has lower value
-            return (overflow_it->first < loaded_block_handle[index].first);
+            return (overflow_it->first < loaded_block_handle.get(index).first);
         }
 
         void increment_logic() {
@@ -435,10 +873,10 @@ public:
         iterator() = default;
 
         // Copy
-        iterator(const iterator &other) : index(other.index),
+        iterator(const iterator &other) : overflow_it(other.overflow_it),
+                                          overflow_end(other.overflow_end),
                                           loaded_block(other.loaded_block),
-                                          overflow_it(other.overflow_it),
-                                          overflow_end(other.overflow_end) {
+                                          index(other.index) {
             if (loaded_block) loaded_block_handle = loaded_block->load();
         }
 
@@ -454,21 +892,22 @@ public:
             return *this;
         }
 
-        // Begin-Constructor
-        iterator(overflow_iterator &&overflow_it, overflow_iterator &&overflow_end, file_block *loaded_block) :
+        // Begin-Constructor (or any position)
+        iterator(overflow_iterator &&overflow_it, overflow_iterator &&overflow_end, file_block *loaded_block,
+                 size_t index = 0) :
                 overflow_it(overflow_it),
                 overflow_end(overflow_end),
-                index(0),
-                loaded_block(loaded_block) {
+                loaded_block(loaded_block),
+                index(index) {
             if (loaded_block) loaded_block_handle = loaded_block->load();
         }
 
         // End-Constructor
         explicit iterator(overflow_iterator &&overflow_end) : overflow_it(overflow_end),
                                                               overflow_end(overflow_it),
-                                                              index(0),
                                                               loaded_block(0),
-                                                              loaded_block_handle() {}
+                                                              loaded_block_handle(),
+                                                              index(0) {}
 
         iterator &operator++() {
             increment_logic();
@@ -485,14 +924,14 @@ public:
             if (take_from_overflow()) {
                 return (reference) *overflow_it;
             }
-            else return (reference) loaded_block_handle[index];
+            else return loaded_block_handle.entry(index);
         }
 
         pointer operator->() {
             if (take_from_overflow()) {
-                return &(*overflow_it);
+                return (pointer) &(*overflow_it);
             }
-            else return (pointer) &loaded_block_handle[index];
+            else return &loaded_block_handle.entry(index);
         }
 
         bool operator==(const iterator &other) const {
@@ -509,7 +948,7 @@ public:
 
     class const_iterator {
     private:
-        typedef typename std::map<TKey, TValue>::const_iterator overflow_iterator;
+        typedef typename std::vector<key_value_pair>::const_iterator overflow_iterator;
 
         // overflow
         overflow_iterator overflow_it;
@@ -527,7 +966,7 @@ public:
             if (overflow_it == overflow_end) return false;
 
             // both have values => check if overflow has lower value
-            return (overflow_it->first < loaded_block_handle[index].first);
+            return (overflow_it->first < loaded_block_handle.get(index).first);
         }
 
         void increment_logic() {
@@ -553,10 +992,10 @@ public:
         const_iterator() = default;
 
         // Copy
-        const_iterator(const const_iterator &other) : index(other.index),
+        const_iterator(const const_iterator &other) : overflow_it(other.overflow_it),
+                                                      overflow_end(other.overflow_end),
                                                       loaded_block(other.loaded_block),
-                                                      overflow_it(other.overflow_it),
-                                                      overflow_end(other.overflow_end) {
+                                                      index(other.index) {
             if (loaded_block) loaded_block_handle = loaded_block->load();
         }
 
@@ -572,22 +1011,23 @@ public:
             return *this;
         }
 
-        // Begin-Constructor
-        const_iterator(overflow_iterator &&overflow_it, overflow_iterator &&overflow_end, file_block *loaded_block)
+        // Begin-Constructor (or any position)
+        const_iterator(overflow_iterator &&overflow_it, overflow_iterator &&overflow_end, file_block *loaded_block,
+                       size_t index = 0)
                 :
                 overflow_it(overflow_it),
                 overflow_end(overflow_end),
-                index(0),
-                loaded_block(loaded_block) {
+                loaded_block(loaded_block),
+                index(index) {
             if (loaded_block) loaded_block_handle = loaded_block->load();
         }
 
         // End-Constructor
         explicit const_iterator(overflow_iterator &&overflow_end) : overflow_it(overflow_end),
                                                                     overflow_end(overflow_it),
-                                                                    index(0),
                                                                     loaded_block(0),
-                                                                    loaded_block_handle() {}
+                                                                    loaded_block_handle(),
+                                                                    index(0) {}
 
         const_iterator &operator++() {
             increment_logic();
@@ -604,14 +1044,14 @@ public:
             if (take_from_overflow()) {
                 return (reference) *overflow_it;
             }
-            else return (reference) loaded_block_handle[index];
+            else return (reference) loaded_block_handle.get(index);
         }
 
         pointer operator->() const {
             if (take_from_overflow()) {
-                return &(*overflow_it);
+                return (pointer) &(*overflow_it);
             }
-            else return (pointer) &loaded_block_handle[index];
+            else return (pointer) &loaded_block_handle.get(index);
         }
 
         bool operator==(const const_iterator &other) const {
@@ -633,13 +1073,163 @@ public:
             default_tvalue(),
 
             overflow{},
-            file_block_map{},
+            file_block_index{},
 
             loaded_block(),
             loaded_block_handle() {}
 
+    /*
+     * Bulk load from a range of key-value pairs sorted by the key, the blocks get filled to fill_factor
+     * (the rest is left for later inserts). Much cheaper than inserting the pairs one by one.
+     */
+    template<typename InputIterator>
+    isam(size_t block_size, size_t overflow_size, InputIterator first, InputIterator last,
+         double fill_factor = FILL_FACTOR_BULK_LOAD) : isam(block_size, overflow_size) {
+        bulk_load(first, last, fill_factor);
+    }
+
     ~isam() { first_file_block.release(); }
 
+    // fsync of a file or a directory
+    static void sync_path(const std::string &path, int flags) {
+        int fd = ::open(path.c_str(), flags);
+        if (fd < 0) throw std::runtime_error("could not open " + path);
+        int result = fsync(fd);
+        close(fd);
+        if (result < 0) throw std::runtime_error("could not sync " + path);
+    }
+
+    /*
+     * Writes the whole isam into the file (trivially copyable keys and values), isam::open maps it back.
+     * Written aside, synced and renamed over the file => a crash leaves either the old or the new file,
+     * an isam opened from the file can be saved back to it.
+     */
+    void save(const std::string &path) const {
+        check_persistable();
+
+        file_header header{};
+        header.magic = FILE_MAGIC;
+        header.key_size = sizeof(TKey);
+        header.value_size = sizeof(TValue);
+        header.pair_size = sizeof(key_value_pair);
+        header.block_size = block_size;
+        header.block_stride = block_stride(block_size);
+        header.max_overflow_size = max_overflow_size;
+        header.block_count = file_block_index.size();
+        header.overflow_count = overflow.size();
+
+        const uint64_t count = header.block_count;
+        uint64_t sections_end = sizeof(file_header) + count * (2 * sizeof(TKey) + sizeof(uint64_t))
+                                + overflow.size() * FILE_OVERFLOW_RECORD;
+        header.blocks_offset = (sections_end + FILE_BLOCKS_ALIGNMENT - 1) / FILE_BLOCKS_ALIGNMENT * FILE_BLOCKS_ALIGNMENT;
+
+        const std::string temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file) throw std::runtime_error("could not create " + temporary);
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (size_t position = 0; position < count; ++position) {
+            file.write(reinterpret_cast<const char *>(&file_block_index.min_key(position)), sizeof(TKey));
+        }
+        for (size_t position = 0; position < count; ++position) {
+            file.write(reinterpret_cast<const char *>(&file_block_index.max_key(position)), sizeof(TKey));
+        }
+        for (size_t position = 0; position < count; ++position) {
+            uint64_t size = file_block_index.block(position)->get_size();
+            file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        }
+        for (auto &pair : overflow) {
+            file.write(reinterpret_cast<const char *>(&pair.first), sizeof(TKey));
+            file.write(reinterpret_cast<const char *>(&pair.second), sizeof(TValue));
+        }
+
+        std::vector<char> padding(std::max<uint64_t>(header.blocks_offset - sections_end, header.block_stride), 0);
+        file.write(padding.data(), header.blocks_offset - sections_end);
+
+        for (size_t position = 0; position < count; ++position) {
+            auto handle = file_block_index.block(position)->load();
+            file.write(handle.data(), file_block::bytes(block_size));
+            file.write(padding.data(), header.block_stride - file_block::bytes(block_size));
+        }
+
+        file.close();
+        if (!file) {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("could not write " + temporary);
+        }
+
+        sync_path(temporary, O_RDONLY);
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("could not replace " + path);
+        }
+
+        auto slash = path.find_last_of('/');
+        sync_path(slash == std::string::npos ? "." : path.substr(0, slash + 1), O_RDONLY | O_DIRECTORY);
+    }
+
+    /*
+     * Opens a file written by save: the file gets mapped (copy-on-write, changes reach the file with
+     * the next save), lookups are served from the mapping right away. Memory mode of the
+     * block provider only.
+     */
+    static isam open(const std::string &path) {
+        check_persistable();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("could not open " + path);
+
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) < 0 || (size_t) file_stat.st_size < sizeof(file_header)) {
+            close(fd);
+            throw std::runtime_error("not an isam file: " + path);
+        }
+
+        size_t length = file_stat.st_size;
+        void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) throw std::runtime_error("could not map " + path);
+        std::shared_ptr<void> mapping(address, [length](void *address) { munmap(address, length); });
+
+        file_header header;
+        std::memcpy(&header, address, sizeof(header));
+
+        // Fences, sizes and the overflow precede the blocks, the blocks end within the file
+        // (checked by divisions - a corrupted count must not overflow the products)
+        const uint64_t fence_bytes = 2 * sizeof(TKey) + sizeof(uint64_t);
+        const bool sections_fit = header.blocks_offset <= length && header.blocks_offset >= sizeof(file_header)
+                && header.block_count <= (header.blocks_offset - sizeof(file_header)) / fence_bytes
+                && header.overflow_count <= (header.blocks_offset - sizeof(file_header)
+                                             - header.block_count * fence_bytes) / FILE_OVERFLOW_RECORD;
+        const bool blocks_fit = sections_fit && header.block_stride
+                && header.block_count <= (length - header.blocks_offset) / header.block_stride;
+
+        if (header.magic != FILE_MAGIC || header.key_size != sizeof(TKey) || header.value_size != sizeof(TValue)
+            || header.pair_size != sizeof(key_value_pair) || header.block_stride != block_stride(header.block_size)
+            || !blocks_fit || header.block_size == 0) {
+            throw std::runtime_error("not an isam file of these types: " + path);
+        }
+
+        // Block sizes within the blocks, the overflow sorted - the lookups rely on both
+        const char *sizes = static_cast<const char *>(address) + sizeof(file_header)
+                            + header.block_count * 2 * sizeof(TKey);
+        for (uint64_t position = 0; position < header.block_count; ++position) {
+            uint64_t size;
+            std::memcpy(&size, sizes + position * sizeof(uint64_t), sizeof(size));
+            if (size == 0 || size > header.block_size) throw std::runtime_error("corrupted block size: " + path);
+        }
+
+        const char *records = sizes + header.block_count * sizeof(uint64_t);
+        for (uint64_t position = 1; position < header.overflow_count; ++position) {
+            TKey previous, key;
+            std::memcpy(&previous, records + (position - 1) * FILE_OVERFLOW_RECORD, sizeof(TKey));
+            std::memcpy(&key, records + position * FILE_OVERFLOW_RECORD, sizeof(TKey));
+            if (!(previous < key)) throw std::runtime_error("corrupted overflow order: " + path);
+        }
+
+        return isam(open_tag(), header, std::move(mapping));
+    }
+
     TValue &operator[](const TKey &key) {
         key_interval ki(key);
         return get_interval_value(ki);
@@ -677,6 +1267,181 @@ public:
     const_iterator end() const {
         return const_iterator(overflow.end());
     }
+
+    /*
+     * Batch lookups: out[i] = value of keys[i] (the default value if missing, nothing gets inserted).
+     * The keys are visited in the key order => every block gets loaded once.
+     */
+    void get_many(const std::vector<TKey> &keys, std::vector<TValue> &out) const {
+        auto order = key_order(keys.size(), [&](size_t i) -> const TKey & { return keys[i]; });
+        out.assign(keys.size(), default_tvalue);
+
+        file_block *current_block = nullptr;
+        file_block_handle handle;
+
+        for (auto i : order) {
+            const TKey &key = keys[i];
+
+            auto position = file_block_index.find(key);
+            if (position != file_block_index.size()) {
+                if (current_block != file_block_index.block(position)) {
+                    current_block = file_block_index.block(position);
+                    handle = current_block->load();
+                }
+
+                auto index = handle.find(key);
+                if (index >= 0) {
+                    out[i] = handle.get(index).second;
+                    continue;
+                }
+            }
+            out[i] = overflow_value(key);
+        }
+    }
+
+    /*
+     * Batch stores (the later pair wins for repeated keys), visited in the key order => every block gets
+     * loaded once. A new key goes straight into a block covering it (or adjacent to it) while the block
+     * has free space, just the rest goes through the overflow.
+     */
+    void put_many(const std::vector<key_value_pair> &pairs) {
+        auto order = key_order(pairs.size(), [&](size_t i) -> const TKey & { return pairs[i].first; });
+
+        // For the overflow, sorted
+        std::vector<key_value_pair> spilled;
+
+        file_block *current_block = nullptr;
+        file_block *written_block = nullptr;
+        file_block_handle handle;
+
+        auto load = [&](size_t position) {
+            if (current_block == file_block_index.block(position)) return;
+            current_block = file_block_index.block(position);
+            handle = current_block->load();
+        };
+
+        // The hook runs before the first change of every block
+        auto prepare_write = [&]() {
+            if (written_block == current_block) return;
+            written_block = current_block;
+            if (before_block_write) before_block_write(current_block);
+        };
+
+        // Inserts into the block at the position if it has free space
+        auto insert = [&](size_t position, const key_value_pair &value) {
+            if (file_block_index.block(position)->get_size() >= block_size) return false;
+            load(position);
+            prepare_write();
+            handle.insert(handle.lower_bound(value.first), value);
+            file_block_index.update(position, handle.min_key(), handle.max_key());
+            return true;
+        };
+
+        for (auto i : order) {
+            const key_value_pair &value = pairs[i];
+            const TKey &key = value.first;
+
+            // Repeated key already spilled
+            if (!spilled.empty() && !(spilled.back().first < key)) {
+                spilled.back().second = value.second;
+                continue;
+            }
+
+            auto position = file_block_index.lower_bound(key);
+            bool covered = position != file_block_index.size() && !(key < file_block_index.min_key(position));
+
+            // Existing key
+            if (covered) {
+                load(position);
+                auto index = handle.find(key);
+                if (index >= 0) {
+                    prepare_write();
+                    handle[index] = value.second;
+                    continue;
+                }
+            }
+
+            auto in_overflow = overflow_lower_bound(key);
+            if (in_overflow != overflow.end() && !(key < in_overflow->first)) {
+                in_overflow->second = value.second;
+                continue;
+            }
+
+            // New key - into the covering block, else behind the previous block or in front of the next one
+            if (covered && insert(position, value)) continue;
+            if (!covered && position > 0 && insert(position - 1, value)) continue;
+            if (!covered && position < file_block_index.size() && insert(position, value)) continue;
+
+            spilled.push_back(value);
+        }
+
+        // Sorted runs => linear merge into the overflow
+        if (!spilled.empty()) {
+            std::vector<key_value_pair> merged;
+            merged.reserve(overflow.size() + spilled.size());
+            std::merge(overflow.begin(), overflow.end(), spilled.begin(), spilled.end(), std::back_inserter(merged),
+                       [](const key_value_pair &a, const key_value_pair &b) { return a.first < b.first; });
+            overflow.swap(merged);
+        }
+
+        handle = file_block_handle();
+        check_flush_overflow();
+    }
+
+    // Iterators of the first key not smaller than the key (lower) or greater than the key (upper)
+
+    iterator lower_bound(const TKey &key) {
+        auto bound = block_bound(key, false);
+        return iterator(overflow_lower_bound(key), overflow.end(), bound.first, bound.second);
+    }
+
+    const_iterator lower_bound(const TKey &key) const {
+        auto bound = block_bound(key, false);
+        return const_iterator(overflow_lower_bound(key), overflow.end(), bound.first, bound.second);
+    }
+
+    iterator upper_bound(const TKey &key) {
+        auto bound = block_bound(key, true);
+        return iterator(overflow_upper_bound(key), overflow.end(), bound.first, bound.second);
+    }
+
+    const_iterator upper_bound(const TKey &key) const {
+        auto bound = block_bound(key, true);
+        return const_iterator(overflow_upper_bound(key), overflow.end(), bound.first, bound.second);
+    }
+
+    std::pair<iterator, iterator> equal_range(const TKey &key) {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const TKey &key) const {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template<typename Iterator>
+    class range_view {
+    private:
+        Iterator first;
+        Iterator last;
+
+    public:
+        range_view(Iterator &&first, Iterator &&last) : first(std::move(first)), last(std::move(last)) {}
+
+        Iterator begin() const { return first; }
+
+        Iterator end() const { return last; }
+    };
+
+    // Keys in [from, to] (both included), the scan starts in the block of from - no insert on miss
+    range_view<iterator> range(const TKey &from, const TKey &to) {
+        if (to < from) return range_view<iterator>(lower_bound(from), lower_bound(from));
+        return range_view<iterator>(lower_bound(from), upper_bound(to));
+    }
+
+    range_view<const_iterator> range(const TKey &from, const TKey &to) const {
+        if (to < from) return range_view<const_iterator>(lower_bound(from), lower_bound(from));
+        return range_view<const_iterator>(lower_bound(from), upper_bound(to));
+    }
 };
 
 #endif // ISAM_ISAM_HPP
\ No newline at end of file
@@ -1,5 +1,11 @@
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <cstdio>
 #include "isam.hpp"
+#include "concurrent_isam.hpp"
+#include "durable_isam.hpp"
 
 using std::string;
 using std::cout;
@@ -80,5 +86,141 @@ int main() {
         }
         std::cout << index[1] << std::endl;
     }
+    {
+        std::cout << " === BULK LOAD === " << std::endl;
+
+        std::vector<std::pair<int, int>> sorted;
+        for (int i = 0; i < 1000; ++i) sorted.emplace_back(i, i);
+
+        isam<int, int> index(4, 2, sorted.begin(), sorted.end());
+        index[1000] = 1000;
+        index[-1] = -1;
+
+        auto count = std::distance(index.begin(), index.end());
+        std::cout << count << " " << index[500] << std::endl;
+    }
+    {
+        std::cout << " === RANGE === " << std::endl;
+
+        isam<int, int> index(3, 2);
+        for (int i = 20; i > 0; --i) index[i * 2] = i;
+
+        for (auto &&it : index.range(9, 16)) cout << it.first << ":" << it.second << " ";
+        std::cout << std::endl;
+
+        auto equal = index.equal_range(10);
+        for (auto it = equal.first; it != equal.second; ++it) cout << it->first << ":" << it->second << " ";
+        std::cout << std::endl;
+    }
+    {
+        std::cout << " === BATCH === " << std::endl;
+
+        isam<int, int> index(4, 2);
+        for (int i = 0; i < 20; ++i) index[i * 3] = i;
+
+        index.put_many({{7, 70}, {3, 30}, {100, 1000}, {7, 77}, {-1, -10}});
+
+        std::vector<int> values;
+        index.get_many({100, 3, 7, 8, -1}, values);
+        for (auto value : values) cout << value << " ";
+        std::cout << std::endl;
+    }
+    {
+        std::cout << " === CONCURRENT === " << std::endl;
+
+        concurrent_isam<int, int> index(4, 8);
+        std::vector<std::thread> threads;
+
+        // Writers of disjoint keys, then readers of all of them
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&index, t]() {
+                for (int i = t; i < 1000; i += 4) index.put(i, i * 2);
+            });
+        }
+        for (auto &thread : threads) thread.join();
+        threads.clear();
+
+        std::vector<long> sums(4);
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&index, &sums, t]() {
+                for (int i = 0; i < 1000; ++i) sums[t] += index.get(i);
+            });
+        }
+        for (auto &thread : threads) thread.join();
+
+        for (auto sum : sums) cout << sum << " ";
+        std::cout << std::endl;
+    }
+    {
+        std::cout << " === SNAPSHOT === " << std::endl;
+
+        concurrent_isam<int, int> index(4, 8);
+        for (int i = 0; i < 100; ++i) index.put(i, i);
+
+        {
+            auto snapshot = index.snapshot();
+            for (int i = 0; i < 100; ++i) index.put(i, -i);
+            index.put(100, 100);
+
+            // The view keeps the values of the snapshot time
+            long sum = 0;
+            snapshot.for_each([&sum](int, int value) { sum += value; });
+            std::cout << snapshot.get(5) << " " << index.get(5) << " " << snapshot.get(100) << " " << sum << std::endl;
+        }
+    }
+    {
+        std::cout << " === DURABLE === " << std::endl;
+        std::remove("durable.isam");
+        std::remove("durable.log");
+
+        {
+            durable_isam<int, int> index("durable.isam", "durable.log", 4, 4);
+            for (int i = 0; i < 100; ++i) index.put(i, i);
+            index.checkpoint();
+            index.put_many({{5, -5}, {200, 200}});
+        }
+
+        // A crash in the middle of a record write
+        {
+            std::ofstream log("durable.log", std::ios::binary | std::ios::app);
+            log.write("torn", 4);
+        }
+
+        {
+            // The checkpoint + the log replayed, the torn record cut off
+            durable_isam<int, int> index("durable.isam", "durable.log", 4, 4);
+            std::cout << index.get(5) << " " << index.get(99) << " " << index.get(200) << std::endl;
+            index.checkpoint();
+            std::cout << index.log_bytes() << std::endl;
+        }
+
+        {
+            durable_isam<int, int> index("durable.isam", "durable.log", 4, 4);
+            std::cout << index.get(5) << " " << index.get(200) << std::endl;
+        }
+
+        std::remove("durable.isam");
+        std::remove("durable.log");
+    }
+    {
+        std::cout << " === FILE PAGES === " << std::endl;
+
+        // The blocks go to a page file cached by a small buffer pool
+        block_provider::open_file("pages.dat", 256, 8);
+        {
+            isam<int, int> index(8, 4);
+            for (int i = 0; i < 500; ++i) index[(i * 7) % 500] = i;
+
+            long sum = 0;
+            for (auto &&it : index) sum += it.second;
+            std::cout << index[7] << " " << index[499] << " " << sum << std::endl;
+        }
+
+        auto statistics = block_provider::statistics();
+        std::cout << "hits " << statistics.hits << " misses " << statistics.misses
+                  << " evictions " << statistics.evictions << " write backs " << statistics.write_backs << std::endl;
+        block_provider::close_file();
+        std::remove("pages.dat");
+    }
     return 0;
 }
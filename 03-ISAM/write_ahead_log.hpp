@@ -0,0 +1,282 @@
+#ifndef ISAM_WRITE_AHEAD_LOG_HPP
+#define ISAM_WRITE_AHEAD_LOG_HPP
+
+#include<string>
+#include<vector>
+#include<algorithm>
+#include<chrono>
+#include<mutex>
+#include<condition_variable>
+#include<exception>
+#include<stdexcept>
+#include<type_traits>
+#include<cstdint>
+#include<cstring>
+#include<cerrno>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+
+// When the leader of a group commit writes the batch: after max_delay or once max_batch_bytes are buffered,
+// a leader without any concurrent writer writes at once
+struct group_commit_options {
+    std::chrono::microseconds max_delay{200};
+    size_t max_batch_bytes = 1 << 20;
+};
+
+/*
+ * Append-only log of key-value records with group commit: append buffers a record and returns its
+ * sequence number, sync(sequence) returns once the record is on disk. The first thread waiting in sync
+ * becomes the leader, lets the others join the batch and writes + fdatasyncs it once for all of them.
+ *
+ * File: header | records, record = key | value | checksum (uint64_t). A torn tail fails the checksum,
+ * replay cuts it off.
+ */
+template<typename TKey, typename TValue>
+class write_ahead_log {
+    static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                  "the log needs trivially copyable keys and values");
+
+private:
+    static constexpr uint64_t LOG_MAGIC = 0x474f4c4d415349ULL; // "ISAMLOG"
+    static constexpr size_t RECORD_SIZE = sizeof(TKey) + sizeof(TValue) + sizeof(uint64_t);
+
+    struct log_header {
+        uint64_t magic;
+        uint64_t key_size;
+        uint64_t value_size;
+    };
+
+    int fd = -1;
+    const group_commit_options options;
+
+    std::mutex mutex;
+    std::condition_variable batch_changed; // a batch grew or got synced
+    std::vector<char> buffer;
+    uint64_t appended = 0;                 // sequence number of the last appended record
+    uint64_t durable = 0;                  // sequence number of the last record on disk
+    bool syncing = false;
+    size_t waiting = 0;                    // threads in sync
+    std::exception_ptr failure;            // a failed batch write - the log is unusable from then on
+    uint64_t log_bytes = 0;
+    size_t sync_count = 0;
+
+    // FNV-1a
+    static uint64_t checksum(const char *data, size_t length) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; ++i) hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+        return hash;
+    }
+
+    void write_all(const char *data, size_t length) {
+        while (length) {
+            auto count = ::write(fd, data, length);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) throw std::runtime_error(std::string("log write failed: ") + strerror(errno));
+            data += count;
+            length -= count;
+        }
+    }
+
+    void sync_file() {
+        if (fdatasync(fd) < 0) throw std::runtime_error(std::string("log sync failed: ") + strerror(errno));
+    }
+
+public:
+    explicit write_ahead_log(const std::string &path, const group_commit_options &options = group_commit_options())
+            : options(options) {
+        fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_APPEND, 0644);
+        if (fd < 0) throw std::runtime_error("could not open log " + path);
+
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) < 0) {
+            close(fd);
+            throw std::runtime_error("could not stat log " + path);
+        }
+
+        log_header expected{LOG_MAGIC, sizeof(TKey), sizeof(TValue)};
+        if (file_stat.st_size == 0) {
+            try {
+                write_all(reinterpret_cast<const char *>(&expected), sizeof(expected));
+                sync_file();
+            }
+            catch (...) {
+                close(fd);
+                throw;
+            }
+            log_bytes = sizeof(expected);
+            return;
+        }
+
+        log_header header{};
+        if (file_stat.st_size < (off_t) sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || std::memcmp(&header, &expected, sizeof(header)) != 0) {
+            close(fd);
+            throw std::runtime_error("not a log of these types: " + path);
+        }
+        log_bytes = file_stat.st_size;
+    }
+
+    ~write_ahead_log() { close(fd); }
+
+    write_ahead_log(const write_ahead_log &) = delete;
+
+    write_ahead_log &operator=(const write_ahead_log &) = delete;
+
+    /*
+     * Calls f(key, value) for every complete record in the log order, cuts off a torn tail.
+     * Call before the first append. Returns the number of records.
+     */
+    template<typename F>
+    size_t replay(F &&f) {
+        const size_t chunk_records = 4096;
+        std::vector<char> chunk(chunk_records * RECORD_SIZE);
+
+        uint64_t offset = sizeof(log_header);
+        size_t count = 0;
+        while (true) {
+            auto read = pread(fd, chunk.data(), chunk.size(), offset);
+            if (read < 0 && errno == EINTR) continue;
+            if (read < 0) throw std::runtime_error(std::string("log read failed: ") + strerror(errno));
+
+            size_t records = read / RECORD_SIZE;
+            size_t valid = 0;
+            for (; valid < records; ++valid) {
+                const char *record = chunk.data() + valid * RECORD_SIZE;
+
+                uint64_t stored;
+                std::memcpy(&stored, record + sizeof(TKey) + sizeof(TValue), sizeof(stored));
+                if (stored != checksum(record, sizeof(TKey) + sizeof(TValue))) break;
+
+                TKey key;
+                TValue value;
+                std::memcpy(&key, record, sizeof(TKey));
+                std::memcpy(&value, record + sizeof(TKey), sizeof(TValue));
+                f(key, value);
+            }
+
+            count += valid;
+            offset += valid * RECORD_SIZE;
+            if (valid < chunk_records) break;
+        }
+
+        // Torn tail
+        if (offset < log_bytes) {
+            if (ftruncate(fd, offset) < 0) throw std::runtime_error("could not cut the log tail");
+            sync_file();
+        }
+        log_bytes = offset;
+        return count;
+    }
+
+    // Buffers the record, returns its sequence number for sync
+    uint64_t append(const TKey &key, const TValue &value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failure) std::rethrow_exception(failure);
+
+        size_t at = buffer.size();
+        buffer.resize(at + RECORD_SIZE);
+        std::memcpy(buffer.data() + at, &key, sizeof(TKey));
+        std::memcpy(buffer.data() + at + sizeof(TKey), &value, sizeof(TValue));
+
+        uint64_t sum = checksum(buffer.data() + at, sizeof(TKey) + sizeof(TValue));
+        std::memcpy(buffer.data() + at + sizeof(TKey) + sizeof(TValue), &sum, sizeof(sum));
+
+        log_bytes += RECORD_SIZE;
+        if (buffer.size() >= options.max_batch_bytes) batch_changed.notify_all();
+        return ++appended;
+    }
+
+    /*
+     * Returns once the record of the sequence number (and all before it) is on disk. Throws the error
+     * of a failed batch write for it and for every later call - the batch is lost, the records after it
+     * can't become durable.
+     */
+    void sync(uint64_t sequence) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        struct waiting_guard {
+            size_t &count;
+
+            explicit waiting_guard(size_t &count) : count(count) { ++count; }
+
+            ~waiting_guard() { --count; }
+        } guard(waiting);
+
+        while (durable < sequence) {
+            if (failure) std::rethrow_exception(failure);
+            if (syncing) {
+                batch_changed.wait(lock);
+                continue;
+            }
+
+            // Leader - let the batch grow if others are writing too (waiting or appended behind it), then write it
+            syncing = true;
+            if (waiting > 1 || appended > sequence) {
+                batch_changed.wait_for(lock, options.max_delay,
+                                       [this] { return buffer.size() >= options.max_batch_bytes; });
+            }
+
+            std::vector<char> batch;
+            batch.swap(buffer);
+            uint64_t last = appended;
+            lock.unlock();
+
+            try {
+                write_all(batch.data(), batch.size());
+                sync_file();
+            }
+            catch (...) {
+                lock.lock();
+                failure = std::current_exception();
+                syncing = false;
+                batch_changed.notify_all();
+                throw;
+            }
+
+            lock.lock();
+            durable = std::max(durable, last);
+            syncing = false;
+            ++sync_count;
+            batch_changed.notify_all();
+        }
+    }
+
+    /*
+     * Drops all the records - they are in a checkpoint now. The caller keeps new appends out meanwhile,
+     * records still buffered count as durable (the checkpoint has to hold them as well).
+     */
+    void truncate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        batch_changed.wait(lock, [this] { return !syncing; });
+        if (failure) std::rethrow_exception(failure);
+
+        buffer.clear();
+        if (ftruncate(fd, sizeof(log_header)) < 0) throw std::runtime_error("could not truncate the log");
+        sync_file();
+
+        log_bytes = sizeof(log_header);
+        durable = appended;
+        batch_changed.notify_all();
+    }
+
+    // Sequence number of the last appended record
+    uint64_t last_sequence() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return appended;
+    }
+
+    // Log size including the buffered records
+    uint64_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return log_bytes;
+    }
+
+    // fdatasync calls so far (one per group commit)
+    size_t syncs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sync_count;
+    }
+};
+
+#endif // ISAM_WRITE_AHEAD_LOG_HPP